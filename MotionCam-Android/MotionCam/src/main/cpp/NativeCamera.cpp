@@ -5,7 +5,9 @@
 
 #include <motioncam/Settings.h>
 #include <motioncam/ImageProcessor.h>
+#include <motioncam/FaceDetector.h>
 #include <motioncam/RawBufferManager.h>
+#include <motioncam/Resources.h>
 #include <json11/json11.hpp>
 
 #include "NativeCameraBridgeListener.h"
@@ -27,6 +29,7 @@ namespace {
     std::shared_ptr<NativeCameraBridgeListener> gCameraSessionListener = nullptr;
     std::shared_ptr<CaptureSessionManager> gCaptureSessionManager = nullptr;
     std::shared_ptr<motioncam::ImageProcessor> gImageProcessor = nullptr;
+    motioncam::FaceDetector gFaceDetector;
     int gCaptureSessionManagerRefs = 0;
 
     std::string gLastError;
@@ -62,6 +65,9 @@ jlong JNICALL Java_com_motioncam_camera_NativeCameraSessionBridge_Create(
         gCaptureSessionManager = std::make_shared<CaptureSessionManager>(maxMemoryUsageBytes);
 
         gCaptureSessionManagerRefs = 1;
+
+        // Load shared resources now rather than on the first capture
+        motioncam::resources::Prewarm();
     }
     catch(const CameraSessionException& e) {
         gLastError = e.what();
@@ -1023,7 +1029,7 @@ jobjectArray JNICALL Java_com_motioncam_camera_NativeCameraSessionBridge_DetectF
         return nullptr;
 
     auto imageBuffer = lockedBuffer->getBuffers().front();
-    auto faces = ImageProcessor::detectFaces(*imageBuffer, metadata);
+    auto faces = gFaceDetector.detect(*imageBuffer, metadata);
 
     jclass nativeRectClass = env->FindClass("android/graphics/RectF");
     auto result = env->NewObjectArray(static_cast<jsize>(faces.size()), nativeRectClass, nullptr);
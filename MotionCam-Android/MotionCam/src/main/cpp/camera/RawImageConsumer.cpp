@@ -23,13 +23,13 @@
 #include "motioncam/CameraProfile.h"
 #include "motioncam/Temperature.h"
 #include <motioncam/ImageProcessor.h>
+#include <motioncam/SettingsEstimator.h>
 
 #include <camera/NdkCameraMetadata.h>
 
 namespace motioncam {
     static const int COPY_THREADS = 1; // More than one copy thread breaks RAW preview
     static const int MINIMUM_BUFFERS = 16;
-    static const int ESTIMATE_SHADOWS_FRAME_INTERVAL = 4;
 
 #ifdef GPU_CAMERA_PREVIEW
     void VERIFY_RESULT(int32_t errCode, const std::string& errString)
@@ -51,7 +51,6 @@ namespace motioncam {
         mTempOffset(0.0f),
         mTintOffset(0.0f),
         mPreviewShadows(4.0f),
-        mPreviewShadowStep(0.0f),
         mCameraDesc(std::move(cameraDescription))
     {
     }
@@ -252,14 +251,10 @@ namespace motioncam {
     }
 
     void RawImageConsumer::onBufferReady(const std::shared_ptr<RawImageBuffer>& buffer) {
-        // Estimate settings every few frames
-        if(mFramesSinceEstimatedSettings >= ESTIMATE_SHADOWS_FRAME_INTERVAL)
-        {
-            // Keep previous value
-            mPreviewShadows = mEstimatedSettings.shadows;
-
-            motioncam::ImageProcessor::estimateSettings(*buffer, mCameraDesc->metadata, mEstimatedSettings);
+        // Every frame adds a few rows to the smoothed estimate
+        mSettingsEstimator.add(*buffer, mCameraDesc->metadata);
 
+        if(mSettingsEstimator.estimate(mEstimatedSettings)) {
             // Update shadows to include user selected boost
             float shadowBoost = 0.0f;
             if(mEnableRawPreview)
@@ -268,19 +263,12 @@ namespace motioncam {
             float userShadows = std::pow(2.0f, std::log(mEstimatedSettings.shadows) / std::log(2.0f) + mShadowBoost);
             mEstimatedSettings.shadows = std::max(1.0f, std::min(32.0f, userShadows));
 
-            // Store noise profile
-            if(!buffer->metadata.noiseProfile.empty()) {
-                mEstimatedSettings.noiseSigma = 1024 * sqrt(0.18 * buffer->metadata.noiseProfile[0] + buffer->metadata.noiseProfile[1]);
-            }
-
-            mPreviewShadowStep = (1.0f / ESTIMATE_SHADOWS_FRAME_INTERVAL) * (mEstimatedSettings.shadows - mPreviewShadows);
-            mFramesSinceEstimatedSettings = 0;
+            mPreviewShadows = mEstimatedSettings.shadows;
         }
-        else {
-            ++mFramesSinceEstimatedSettings;
 
-            // Interpolate shadows to make transition smoother
-            mPreviewShadows += mPreviewShadowStep;
+        // Store noise profile
+        if(!buffer->metadata.noiseProfile.empty()) {
+            mEstimatedSettings.noiseSigma = 1024 * sqrt(0.18 * buffer->metadata.noiseProfile[0] + buffer->metadata.noiseProfile[1]);
         }
 
         RawBufferManager::get().enqueueReadyBuffer(buffer);
@@ -555,11 +543,14 @@ namespace motioncam {
 
         LOGI("Enabling RAW preview mode");
 
+        // Reset the estimate before the preprocess thread starts adding frames to it
+        mEstimatedSettings = PostProcessSettings();
+        mSettingsEstimator.reset();
+
         mPreviewListener  = std::move(listener);
         mEnableRawPreview = true;
         mRawPreviewQuality = previewQuality;
         mPreprocessThread = std::make_shared<std::thread>(&RawImageConsumer::doPreprocess, this);
-        mEstimatedSettings = PostProcessSettings();
     }
 
     void RawImageConsumer::updateRawPreviewSettings(
@@ -9,6 +9,7 @@
 #include <chrono>
 
 #include <motioncam/RawImageMetadata.h>
+#include <motioncam/SettingsEstimator.h>
 
 #ifdef GPU_CAMERA_PREVIEW
     #include <HalideBuffer.h>
@@ -75,13 +76,12 @@ namespace motioncam {
         std::atomic<float> mTempOffset;
         std::atomic<float> mTintOffset;
         PostProcessSettings mEstimatedSettings;
+        SettingsEstimator mSettingsEstimator;
         float mPreviewShadows;
-        float mPreviewShadowStep;
 
         std::shared_ptr<CameraDescription> mCameraDesc;
         int mRawPreviewQuality;
         bool mCopyCaptureColorTransform;
-        int mFramesSinceEstimatedSettings;
 
         moodycamel::BlockingConcurrentQueue<std::shared_ptr<AImage>> mImageQueue;
         moodycamel::ConcurrentQueue<RawImageMetadata> mPendingMetadata;
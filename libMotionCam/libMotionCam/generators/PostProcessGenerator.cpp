@@ -1632,6 +1632,8 @@ public:
     // Inputs and outputs
     GeneratorParam<int> tonemap_levels {"tonemap_levels", 9};
     GeneratorParam<Type> output_type{"output_type", UInt(16)};
+    GeneratorParam<bool> fixed_point{"fixed_point", false};
+    GeneratorParam<int> blend_level{"blend_level", 0};
 
     Input<Func> input0{"input0", 3 };
     Input<Func> input1{"input1", 3 };
@@ -1668,12 +1670,16 @@ public:
     void pyramidDown(Func& output, Type outputType, Func& intermediate, Func input);
     
     vector<pair<Func, Func>> buildPyramid(Func input, Type outputType, int maxlevel);
+    Func guidedUpsample(Func guide, Func guideLow, Func inputLow);
 
     void generate();
     void schedule();
 
     vector<pair<Func, Func>> tonemapPyramid;
     vector<pair<Func, Func>> weightsPyramid;
+
+    Func guidedMean;
+    Func guidedCoeffsMean;
 };
 
 void TonemapGenerator::pyramidUp(Func& output, Type outputType, Func& intermediate, Func input) {
@@ -1760,6 +1766,115 @@ vector<pair<Func, Func>> TonemapGenerator::buildPyramid(Func input, Type outputT
     return pyramid;
 }
 
+Func TonemapGenerator::guidedUpsample(Func guide, Func guideLow, Func inputLow) {
+    const int blendLevel = blend_level;
+    const int scale = 1 << blendLevel;
+
+    Expr type_max = ((Type)output_type).max();
+    Expr pyramidMax = cast<float>(fixed_point ? type_max / 2 : type_max);
+
+    Expr lowWidth = width >> blendLevel;
+    Expr lowHeight = height >> blendLevel;
+
+    // Fit the blended result as a linear function of the guide over small windows at low resolution
+    Func lowInput{"guidedLowInput"};
+    Func lowInputClamped;
+    Func boxX{"guidedBoxX"}, mean{"guidedMean"};
+
+    lowInput(v_x, v_y, v_c, v_i) = mux(v_i,
+        {   guideLow(v_x, v_y, v_c, 0) / pyramidMax,
+            inputLow(v_x, v_y, v_c) / pyramidMax });
+
+    lowInputClamped = BoundaryConditions::repeat_edge(lowInput, { {0, lowWidth}, {0, lowHeight} } );
+
+    Expr I = lowInputClamped(v_x, v_y, v_c, 0);
+    Expr p = lowInputClamped(v_x, v_y, v_c, 1);
+
+    Func products{"guidedProducts"};
+
+    products(v_x, v_y, v_c, v_i) = mux(v_i, { I, p, I*p, I*I });
+
+    boxX(v_x, v_y, v_c, v_i) = (products(v_x - 1, v_y, v_c, v_i) + products(v_x, v_y, v_c, v_i) + products(v_x + 1, v_y, v_c, v_i)) / 3.0f;
+    mean(v_x, v_y, v_c, v_i) = (boxX(v_x, v_y - 1, v_c, v_i) + boxX(v_x, v_y, v_c, v_i) + boxX(v_x, v_y + 1, v_c, v_i)) / 3.0f;
+
+    Expr meanI = mean(v_x, v_y, v_c, 0);
+    Expr meanP = mean(v_x, v_y, v_c, 1);
+
+    Expr a = (mean(v_x, v_y, v_c, 2) - meanI*meanP) / (mean(v_x, v_y, v_c, 3) - meanI*meanI + 1e-4f);
+    Expr b = meanP - a*meanI;
+
+    Func coeffs{"guidedCoeffs"};
+    Func coeffsClamped;
+    Func coeffsBoxX{"guidedCoeffsBoxX"}, coeffsMean{"guidedCoeffsMean"};
+
+    coeffs(v_x, v_y, v_c, v_i) = select(v_i == 0, a, b);
+
+    coeffsClamped = BoundaryConditions::repeat_edge(coeffs, { {0, lowWidth}, {0, lowHeight} } );
+
+    coeffsBoxX(v_x, v_y, v_c, v_i) =
+        (coeffsClamped(v_x - 1, v_y, v_c, v_i) + coeffsClamped(v_x, v_y, v_c, v_i) + coeffsClamped(v_x + 1, v_y, v_c, v_i)) / 3.0f;
+
+    coeffsMean(v_x, v_y, v_c, v_i) =
+        (coeffsBoxX(v_x, v_y - 1, v_c, v_i) + coeffsBoxX(v_x, v_y, v_c, v_i) + coeffsBoxX(v_x, v_y + 1, v_c, v_i)) / 3.0f;
+
+    // Apply the interpolated fit to the full resolution guide
+    Func C = BoundaryConditions::repeat_edge(coeffsMean, { {0, lowWidth}, {0, lowHeight} } );
+
+    Expr fx = cast<float>(v_x) / scale;
+    Expr fy = cast<float>(v_y) / scale;
+
+    Expr ix = cast<int>(fx);
+    Expr iy = cast<int>(fy);
+
+    Expr ax = fx - ix;
+    Expr ay = fy - iy;
+
+    Expr A = lerp(lerp(C(ix, iy, v_c, 0), C(ix + 1, iy, v_c, 0), ax), lerp(C(ix, iy + 1, v_c, 0), C(ix + 1, iy + 1, v_c, 0), ax), ay);
+    Expr B = lerp(lerp(C(ix, iy, v_c, 1), C(ix + 1, iy, v_c, 1), ax), lerp(C(ix, iy + 1, v_c, 1), C(ix + 1, iy + 1, v_c, 1), ax), ay);
+
+    Func result{"guidedUpsampled"};
+
+    result(v_x, v_y, v_c) = A * guide(v_x, v_y, v_c, 0) / cast<float>(type_max) + B;
+
+    if(!auto_schedule) {
+        boxX
+            .compute_at(mean, v_y)
+            .reorder(v_i, v_c, v_x, v_y)
+            .unroll(v_i)
+            .unroll(v_c)
+            .vectorize(v_x, 8);
+
+        // Computed per output tile in generate(), the float planes are too large to keep at half resolution
+        mean
+            .bound(v_c, 0, 3)
+            .bound(v_i, 0, 4)
+            .reorder(v_i, v_c, v_x, v_y)
+            .unroll(v_i)
+            .unroll(v_c)
+            .vectorize(v_x, 8);
+
+        coeffsBoxX
+            .compute_at(coeffsMean, v_y)
+            .reorder(v_i, v_c, v_x, v_y)
+            .unroll(v_i)
+            .unroll(v_c)
+            .vectorize(v_x, 8);
+
+        coeffsMean
+            .bound(v_c, 0, 3)
+            .bound(v_i, 0, 2)
+            .reorder(v_i, v_c, v_x, v_y)
+            .unroll(v_i)
+            .unroll(v_c)
+            .vectorize(v_x, 8);
+    }
+
+    guidedMean = mean;
+    guidedCoeffsMean = coeffsMean;
+
+    return result;
+}
+
 void TonemapGenerator::generate() {
     Func gammaLut{"gammaLut"}, inverseGammaLut{"inverseGammaLut"};
     Expr type_max = ((Type)output_type).max();
@@ -1819,8 +1934,15 @@ void TonemapGenerator::generate() {
             .vectorize(v_x, 8);
     }
 
-    // Create pyramid input
-    tonemapPyramid = buildPyramid(exposures, UInt(16), tonemap_levels);
+    // Create pyramid input. The fixed point pyramids hold 15 bit values so the laplacians fit in 16 bits.
+    Func pyramidInput{"pyramidInput"};
+
+    if(fixed_point)
+        pyramidInput(v_x, v_y, v_c, v_i) = exposures(v_x, v_y, v_c, v_i) >> 1;
+    else
+        pyramidInput(v_x, v_y, v_c, v_i) = exposures(v_x, v_y, v_c, v_i);
+
+    tonemapPyramid = buildPyramid(pyramidInput, UInt(16), tonemap_levels);
     weightsPyramid = buildPyramid(weightsNormalized, UInt(16), tonemap_levels);
 
     if(!auto_schedule) {
@@ -1865,16 +1987,22 @@ void TonemapGenerator::generate() {
     // Create laplacian pyramid
     //
 
-    vector<Func> laplacianPyramid, combinedPyramid;
-    
-    for(int level = 0; level < tonemap_levels; level++) {
+    const int numLevels = tonemap_levels;
+    const int blendLevel = blend_level;
+
+    Type laplacianType = fixed_point ? Int(16) : Int(32);
+
+    vector<Func> laplacianPyramid(numLevels + 1), combinedPyramid(numLevels + 1);
+
+    for(int level = blendLevel; level < numLevels; level++) {
         Func up("laplacianUpLvl" + std::to_string(level));
         Func upIntermediate("laplacianUpIntermediateLvl" + std::to_string(level));
         Func laplacian("laplacianLvl" + std::to_string(level));
 
         pyramidUp(up, Int(32), upIntermediate, tonemapPyramid[level + 1].second);
-        
-        laplacian(v_x, v_y, v_c, v_i) = cast<int32_t>(tonemapPyramid[level].second(v_x, v_y, v_c, v_i)) - up(v_x, v_y, v_c, v_i);
+
+        laplacian(v_x, v_y, v_c, v_i) =
+            cast(laplacianType, cast<int32_t>(tonemapPyramid[level].second(v_x, v_y, v_c, v_i)) - up(v_x, v_y, v_c, v_i));
 
         if(level > 2) {
             upIntermediate
@@ -1892,24 +2020,40 @@ void TonemapGenerator::generate() {
                 .vectorize(v_xi, 8);
         }
 
-        laplacianPyramid.push_back(laplacian);
+        laplacianPyramid[level] = laplacian;
     }
 
-    laplacianPyramid.push_back(tonemapPyramid[tonemap_levels].second);
+    Func laplacianTop{"laplacianTop"};
+
+    laplacianTop(v_x, v_y, v_c, v_i) = cast(laplacianType, tonemapPyramid[numLevels].second(v_x, v_y, v_c, v_i));
+
+    laplacianPyramid[numLevels] = laplacianTop;
 
     //
     // Combine pyramids
     //
 
-    for(int level = 0; level <= tonemap_levels; level++) {
+    for(int level = blendLevel; level <= numLevels; level++) {
         Func result("resultLvl" + std::to_string(level));
 
-        result(v_x, v_y, v_c) = cast<int32_t>(0.5f + 
-            (laplacianPyramid[level](v_x, v_y, v_c, 0) * 1.0f/16384.0f*weightsPyramid[level].second(v_x, v_y, 0)) +
-            (laplacianPyramid[level](v_x, v_y, v_c, 1) * 1.0f/16384.0f*weightsPyramid[level].second(v_x, v_y, 1)) +
-            (laplacianPyramid[level](v_x, v_y, v_c, 2) * 1.0f/16384.0f*weightsPyramid[level].second(v_x, v_y, 2)));
+        if(fixed_point) {
+            Expr w0 = cast<int32_t>(weightsPyramid[level].second(v_x, v_y, 0));
+            Expr w1 = cast<int32_t>(weightsPyramid[level].second(v_x, v_y, 1));
+            Expr w2 = cast<int32_t>(weightsPyramid[level].second(v_x, v_y, 2));
+
+            result(v_x, v_y, v_c) = cast<int16_t>((
+                laplacianPyramid[level](v_x, v_y, v_c, 0) * w0 +
+                laplacianPyramid[level](v_x, v_y, v_c, 1) * w1 +
+                laplacianPyramid[level](v_x, v_y, v_c, 2) * w2 + (1 << 13)) >> 14);
+        }
+        else {
+            result(v_x, v_y, v_c) = cast<int32_t>(0.5f +
+                (laplacianPyramid[level](v_x, v_y, v_c, 0) * 1.0f/16384.0f*weightsPyramid[level].second(v_x, v_y, 0)) +
+                (laplacianPyramid[level](v_x, v_y, v_c, 1) * 1.0f/16384.0f*weightsPyramid[level].second(v_x, v_y, 1)) +
+                (laplacianPyramid[level](v_x, v_y, v_c, 2) * 1.0f/16384.0f*weightsPyramid[level].second(v_x, v_y, 2)));
+        }
 
-        combinedPyramid.push_back(result);
+        combinedPyramid[level] = result;
     }
 
     //
@@ -1918,12 +2062,12 @@ void TonemapGenerator::generate() {
     
     vector<Func> outputPyramid;
 
-    for(int level = tonemap_levels; level > 0; level--) {
+    for(int level = numLevels; level > blendLevel; level--) {
         Func up("outputUpLvl" + std::to_string(level));
         Func upIntermediate("outputUpIntermediateLvl" + std::to_string(level));
         Func outputLvl("outputLvl" + std::to_string(level));
 
-        if(level == tonemap_levels) {
+        if(level == numLevels) {
             pyramidUp(up, Int(32), upIntermediate, combinedPyramid[level]);
         }
         else {
@@ -1931,7 +2075,10 @@ void TonemapGenerator::generate() {
             
         }
 
-        outputLvl(v_x, v_y, v_c) = saturating_cast<uint16_t>(combinedPyramid[level - 1](v_x, v_y, v_c) + up(v_x, v_y, v_c));
+        if(fixed_point)
+            outputLvl(v_x, v_y, v_c) = saturating_cast<int16_t>(combinedPyramid[level - 1](v_x, v_y, v_c) + up(v_x, v_y, v_c));
+        else
+            outputLvl(v_x, v_y, v_c) = saturating_cast<uint16_t>(combinedPyramid[level - 1](v_x, v_y, v_c) + up(v_x, v_y, v_c));
 
         if(!auto_schedule) {
             combinedPyramid[level - 1].compute_at(outputLvl, tile_idx)
@@ -1953,16 +2100,45 @@ void TonemapGenerator::generate() {
         outputPyramid.push_back(outputLvl);
     }
 
-    // Inverse gamma correct tonemapped result
-    output(v_x, v_y, v_c) = inverseGammaLut(cast(output_type, clamp(outputPyramid[tonemap_levels - 1](v_x, v_y, v_c), 0, type_max)));
+    Func collapsed = outputPyramid[outputPyramid.size() - 1];
+
+    if(blendLevel == 0) {
+        // Inverse gamma correct tonemapped result
+        output(v_x, v_y, v_c) = inverseGammaLut(
+            cast(output_type, clamp(cast<int32_t>(collapsed(v_x, v_y, v_c)) << (fixed_point ? 1 : 0), 0, type_max)));
+    }
+    else {
+        // Blended at low resolution, use the unmodified exposure to bring the result back to full resolution
+        Func upsampled = guidedUpsample(exposures, tonemapPyramid[blendLevel].second, collapsed);
+
+        output(v_x, v_y, v_c) = inverseGammaLut(
+            cast(output_type, clamp(upsampled(v_x, v_y, v_c) * type_max + 0.5f, 0.0f, cast<float>(type_max))));
+    }
 
     if(!auto_schedule) {
-        output
-            .compute_root()
-            .bound(v_c, 0, 3)
-            .parallel(v_y)
-            .unroll(v_c)
-            .vectorize(v_x, 8);
+        if(blendLevel == 0) {
+            output
+                .compute_root()
+                .bound(v_c, 0, 3)
+                .parallel(v_y)
+                .unroll(v_c)
+                .vectorize(v_x, 8);
+        }
+        else {
+            output
+                .compute_root()
+                .bound(v_c, 0, 3)
+                .reorder(v_c, v_x, v_y)
+                .tile(v_x, v_y, v_xo, v_yo, v_xi, v_yi, 256, 64)
+                .fuse(v_xo, v_yo, tile_idx)
+                .parallel(tile_idx)
+                .unroll(v_c)
+                .vectorize(v_xi, 8);
+
+            // Fit the guided filter for each tile with a small halo, in cache
+            guidedMean.compute_at(output, tile_idx);
+            guidedCoeffsMean.compute_at(output, tile_idx);
+        }
     }
 
     width.set_estimate(4096);
@@ -2398,12 +2574,23 @@ void DeghostGenerator::generate() {
     width.set_estimate(2048);
     height.set_estimate(1536);
 
+    for(size_t i = 0; i < input.size(); i++) {
+        input[i].set_estimates({{0, 2048}, {0, 1536}, {0, 4}});
+        warpMatrix[i].set_estimates({{0, 3}, {0, 3}});
+    }
+
     output.set_estimates({{0, 2048}, {0, 1536}, {0, 4}});
 
 }
 
 class PostProcessGenerator : public Halide::Generator<PostProcessGenerator>, public PostProcessBase {
 public:
+    // When disabled hdrInput and useHdr are ignored and can be given a 1x1 buffer
+    GeneratorParam<bool> enableHdr{"enable_hdr", true};
+    
+    // uint8 output is dithered, uint16 output skips dithering and blueNoise is ignored
+    GeneratorParam<Type> output_type{"output_type", UInt(8)};
+
     Input<Buffer<uint16_t>> in0{"in0", 2 };
     Input<Buffer<uint16_t>> in1{"in1", 2 };
     Input<Buffer<uint16_t>> in2{"in2", 2 };
@@ -2443,8 +2630,9 @@ public:
     Input<float> chromaEps1{"chromaEps1"};
     Input<float> chromaEps3{"chromaEps3"};
 
-    Output<Buffer<uint8_t>> output{"output", 3};
+    Output<Buffer<>> output{"output", 3};
     
+    Func finalOutput{"finalOutput"};
     Func chromaEpsMap{"chromaEpsMap"}, chromaEps{"chromaEps"};
     Func Lmap{"Lmap"};
     Func LmapTmp0{"LmapTmp0"}, LmapTmp1{"LmapTmp1"}, LmapTmp2{"LmapTmp2"}, LmapTmp3{"LmapTmp3"};
@@ -2534,9 +2722,14 @@ void PostProcessGenerator::generate()
 
     highlights(v_x, v_y, v_c) = (hdrMask(v_x, v_y)*hdrInputRepeated(v_x, v_y, v_c)) + ((1.0f - hdrMask(v_x, v_y))*hdrScale*baseInput(v_x, v_y, v_c));
 
-    hdrTonemapInput(v_x, v_y, v_c) = select(useHdr, 
-        saturating_cast<uint16_t>(hdrInputGain * highlights(v_x, v_y, v_c) * 65535.0f),
-        tonemapInput(v_x, v_y, v_c));
+    if(enableHdr) {
+        hdrTonemapInput(v_x, v_y, v_c) = select(useHdr, 
+            saturating_cast<uint16_t>(hdrInputGain * highlights(v_x, v_y, v_c) * 65535.0f),
+            tonemapInput(v_x, v_y, v_c));
+    }
+    else {
+        hdrTonemapInput(v_x, v_y, v_c) = tonemapInput(v_x, v_y, v_c);
+    }
 
     //
     // Tonemap
@@ -2580,20 +2773,34 @@ void PostProcessGenerator::generate()
         sharpen1,
         pop);
 
-    // Finish with blue noise dithering + gamma
-    Expr h = v_i / 255.0f;
+    if(((Type) output_type) == UInt(16)) {
+        // Gamma at full precision, no dithering needed
+        Expr h = v_i / 65535.0f;
 
-    gammaLut(v_i) = saturating_cast<uint8_t>(select(h < 0.0031308f, h * 12.92f, pow(h, 1.0f / 2.4f) * 1.055f - 0.055f) * 255.0f + 0.5f);
-    if(!auto_schedule)
-        gammaLut.compute_root().vectorize(v_i, 8);
+        gammaLut(v_i) = saturating_cast<uint16_t>(select(h < 0.0031308f, h * 12.92f, pow(h, 1.0f / 2.4f) * 1.055f - 0.055f) * 65535.0f + 0.5f);
+        if(!auto_schedule)
+            gammaLut.compute_root().vectorize(v_i, 8);
 
-    // Dither using blue noise
-    noiseInput(v_x, v_y, v_c) = BoundaryConditions::repeat_image(blueNoise)(v_x, v_y, v_c) * 2.0f/255.0f - 1.0f;
+        finalOutput(v_x, v_y, v_c) = gammaLut(enhance->output(v_x, v_y, v_c));
+    }
+    else {
+        // Finish with blue noise dithering + gamma
+        Expr h = v_i / 255.0f;
 
-    Expr S = select(noiseInput(v_x, v_y, v_c) < 0.0f, -1.0f, 1.0f);
-    noise(v_x, v_y, v_c) = S*(1.0f - sqrt(max(0.0f, 1.0f - abs(noiseInput(v_x, v_y, v_c)))));
+        gammaLut(v_i) = saturating_cast<uint8_t>(select(h < 0.0031308f, h * 12.92f, pow(h, 1.0f / 2.4f) * 1.055f - 0.055f) * 255.0f + 0.5f);
+        if(!auto_schedule)
+            gammaLut.compute_root().vectorize(v_i, 8);
+
+        // Dither using blue noise
+        noiseInput(v_x, v_y, v_c) = BoundaryConditions::repeat_image(blueNoise)(v_x, v_y, v_c) * 2.0f/255.0f - 1.0f;
+
+        Expr S = select(noiseInput(v_x, v_y, v_c) < 0.0f, -1.0f, 1.0f);
+        noise(v_x, v_y, v_c) = S*(1.0f - sqrt(max(0.0f, 1.0f - abs(noiseInput(v_x, v_y, v_c)))));
 
-    output(v_x, v_y, v_c) = gammaLut(saturating_cast<uint8_t>(0.5f + enhance->output(v_x, v_y, v_c) * 255.0f / 65535.0f + noise(v_x, v_y, v_c)));
+        finalOutput(v_x, v_y, v_c) = gammaLut(saturating_cast<uint8_t>(0.5f + enhance->output(v_x, v_y, v_c) * 255.0f / 65535.0f + noise(v_x, v_y, v_c)));
+    }
+
+    output = finalOutput;
 
     // Noise/output are interleaved
     blueNoise
@@ -2620,8 +2827,14 @@ void PostProcessGenerator::generate()
     sharpen1.set_estimate(2.0f);
     chromaEps0.set_estimate(0.01f);
     chromaEps1.set_estimate(0.01f);
+    chromaEps3.set_estimate(0.01f);
+    pop.set_estimate(1.25f);
+    useHdr.set_estimate(false);
+    hdrInputGain.set_estimate(1.0f);
+    hdrScale.set_estimate(1.0f);
     
     cameraToSrgb.set_estimates({{0, 3}, {0, 3}});
+    blueNoise.set_estimates({{0, 256}, {0, 256}, {0, 4}});
 
     in0.set_estimates({{0, 2048}, {0, 1536}});
     in1.set_estimates({{0, 2048}, {0, 1536}});
@@ -2695,13 +2908,16 @@ void PostProcessGenerator::schedule_for_cpu() {
         .parallel(v_yo)
         .parallel(v_c);
 
-    hdrTonemapInput
-        .compute_root()
-            .bound(v_c, 0, 3)
-            .reorder(v_c, v_x, v_y)
-            .parallel(v_y)
-            .unroll(v_c)
-            .vectorize(v_x, vector_size_u16);
+    // Without HDR this is the same as the base exposure and is inlined
+    if(enableHdr) {
+        hdrTonemapInput
+            .compute_root()
+                .bound(v_c, 0, 3)
+                .reorder(v_c, v_x, v_y)
+                .parallel(v_y)
+                .unroll(v_c)
+                .vectorize(v_x, vector_size_u16);
+    }
 
     output
         .compute_root()
@@ -2710,7 +2926,7 @@ void PostProcessGenerator::schedule_for_cpu() {
         .split(v_y, v_yo, v_yi, 64)
         .parallel(v_yo)
         .unroll(v_c)
-        .vectorize(v_x, vector_size_u8);
+        .vectorize(v_x, ((Type) output_type) == UInt(16) ? vector_size_u16 : vector_size_u8);
 }
 
 //
@@ -2967,6 +3183,346 @@ void PreviewGenerator::schedule_for_cpu() {
         .vectorize(v_xi, vector_size_u8);
 }
 
+// Lower quality preview in a single pass for speed. Tonemaps with a smoothed two exposure gain grid instead of the
+// pyramid and skips sharpening, pop and the blues/greens adjustments of PreviewGenerator.
+class FusedPreviewGenerator : public Halide::Generator<FusedPreviewGenerator>, public PostProcessBase {
+public:
+    GeneratorParam<int> rotation{"rotation", 0};
+    GeneratorParam<int> downscaleFactor{"downscale_factor", 2};
+    GeneratorParam<int> gainScale{"gain_scale", 16};
+
+    Input<Buffer<uint8_t>> input{"input", 1};
+
+    Input<Buffer<float>> inShadingMap0{"inShadingMap0", 2 };
+    Input<Buffer<float>> inShadingMap1{"inShadingMap1", 2 };
+    Input<Buffer<float>> inShadingMap2{"inShadingMap2", 2 };
+    Input<Buffer<float>> inShadingMap3{"inShadingMap3", 2 };
+
+    Input<float[3]> asShotVector{"asShotVector"};
+    Input<Buffer<float>> cameraToSrgb{"cameraToSrgb", 2};
+
+    Input<int> width{"width"};
+    Input<int> height{"height"};
+    Input<int> stride{"stride"};
+    Input<int> pixelFormat{"pixelFormat"};
+
+    Input<int> sensorArrangement{"sensorArrangement"};
+
+    Input<int16_t[4]> blackLevel{"blackLevel"};
+    Input<int16_t> whiteLevel{"whiteLevel"};
+
+    Input<float> shadows{"shadows"};
+    Input<float> whitePoint{"whitePoint"};
+    Input<float> tonemapVariance{"tonemapVariance"};
+    Input<float> blackPoint{"blackPoint"};
+    Input<float> exposure{"exposure"};
+    Input<float> contrast{"contrast"};
+    Input<float> saturation{"saturation"};
+
+    Input<bool> flipped{"flipped"};
+
+    Output<Buffer<uint8_t>> output{"output", 3};
+
+    void generate();
+    void schedule_for_cpu();
+
+private:
+    void linearRgb(Func& result, Func& srgbInput, Func bayer, Expr w, Expr h);
+
+private:
+    Func in[4];
+    Func inMuxed{"inMuxed"};
+    Func downscaled{"downscaled"};
+    Func lowBayer{"lowBayer"};
+    Func lowSrgbInput{"lowSrgbInput"};
+    Func lowRgb{"lowRgb"};
+    Func lowGain{"lowGain"};
+    Func lowGainX{"lowGainX"};
+    Func lowGainBlurred{"lowGainBlurred"};
+    Func gain{"gain"};
+    Func srgbInput{"srgbInput"};
+    Func rgb{"rgb"};
+    Func contrastLut{"contrastLut"};
+    Func curve{"curve"};
+    Func finalRgb{"finalRgb"};
+
+    RDom r;
+};
+
+void FusedPreviewGenerator::linearRgb(Func& result, Func& srgbInput, Func bayer, Expr w, Expr h) {
+    Func shadingMap[4];
+    Func demosaicInput;
+    Func srgb;
+
+    linearScale(shadingMap[0], inShadingMap0, inShadingMap0.width(), inShadingMap0.height(), w, h);
+    linearScale(shadingMap[1], inShadingMap1, inShadingMap1.width(), inShadingMap1.height(), w, h);
+    linearScale(shadingMap[2], inShadingMap2, inShadingMap2.width(), inShadingMap2.height(), w, h);
+    linearScale(shadingMap[3], inShadingMap3, inShadingMap3.width(), inShadingMap3.height(), w, h);
+
+    rearrange(demosaicInput, bayer, sensorArrangement);
+
+    Expr c0 = (demosaicInput(v_x, v_y, 0) - blackLevel[0]) / (cast<float>(whiteLevel - blackLevel[0])) * shadingMap[0](v_x, v_y);
+    Expr c1 = (demosaicInput(v_x, v_y, 1) - blackLevel[1]) / (cast<float>(whiteLevel - blackLevel[1])) * shadingMap[1](v_x, v_y);
+    Expr c2 = (demosaicInput(v_x, v_y, 2) - blackLevel[2]) / (cast<float>(whiteLevel - blackLevel[2])) * shadingMap[2](v_x, v_y);
+    Expr c3 = (demosaicInput(v_x, v_y, 3) - blackLevel[3]) / (cast<float>(whiteLevel - blackLevel[3])) * shadingMap[3](v_x, v_y);
+
+    srgbInput(v_x, v_y, v_c) = select(v_c == 0,  clamp( c0,               0.0f, asShotVector[0] ),
+                                      v_c == 1,  clamp( (c1 + c2) / 2,    0.0f, asShotVector[1] ),
+                                                 clamp( c3,               0.0f, asShotVector[2] ));
+
+    transform(srgb, srgbInput, cameraToSrgb);
+
+    result(v_x, v_y, v_c) = clamp(srgb(v_x, v_y, v_c) * pow(2.0f, exposure), 0.0f, 1.0f);
+}
+
+void FusedPreviewGenerator::generate() {
+    const int f = downscaleFactor;
+    const int g = gainScale;
+
+    // Deinterleave
+    deinterleave(in[0], input, 0, stride, pixelFormat);
+    deinterleave(in[1], input, 1, stride, pixelFormat);
+    deinterleave(in[2], input, 2, stride, pixelFormat);
+    deinterleave(in[3], input, 3, stride, pixelFormat);
+
+    inMuxed(v_x, v_y, v_c) =
+        mux(v_c,
+            {   in[0](v_x, v_y),
+                in[1](v_x, v_y),
+                in[2](v_x, v_y),
+                in[3](v_x, v_y) });
+
+    Func inClamped = Halide::BoundaryConditions::repeat_edge(inMuxed, { { 0, width * f }, { 0, height * f } } );
+
+    // Box downscale, unrolled so it runs inside the output tiles
+    Expr box = 0.0f;
+
+    for(int y = 0; y < f; y++) {
+        for(int x = 0; x < f; x++) {
+            box += cast<float>(inClamped(v_x*f + x, v_y*f + y, v_c));
+        }
+    }
+
+    downscaled(v_x, v_y, v_c) = box / (f*f);
+
+    //
+    // Tonemap gain. Blends the image with a copy brightened by the shadows gain, weighted by how well
+    // exposed each one is, like the tonemap pyramid but on a grid downscaled by gain_scale.
+    // The gain is then smoothed and interpolated back up to the preview.
+    //
+
+    Expr lowWidth = (width + g - 1) / g;
+    Expr lowHeight = (height + g - 1) / g;
+
+    // Every other pixel is enough for the average
+    const int n = f*g / 2;
+    r = RDom(0, n, 0, n);
+
+    lowBayer(v_x, v_y, v_c) = 0.0f;
+    lowBayer(v_x, v_y, v_c) += cast<float>(inClamped(v_x*f*g + r.x*2, v_y*f*g + r.y*2, v_c)) / (n*n);
+
+    linearRgb(lowRgb, lowSrgbInput, lowBayer, lowWidth, lowHeight);
+
+    auto gamma = [](Expr x) {
+        return select(x < 0.0031308f, x * 12.92f, pow(x, 1.0f / 2.4f) * 1.055f - 0.055f);
+    };
+
+    Expr Y = 0.299f*lowRgb(v_x, v_y, 0) + 0.587f*lowRgb(v_x, v_y, 1) + 0.114f*lowRgb(v_x, v_y, 2);
+
+    Expr e0 = gamma(Y) - 0.5f;
+    Expr e1 = gamma(min(Y * shadows, 1.0f)) - 0.5f;
+
+    Expr w0 = exp(-e0*e0 / (2 * tonemapVariance * tonemapVariance)) + 1e-5f;
+    Expr w1 = exp(-e1*e1 / (2 * tonemapVariance * tonemapVariance));
+
+    lowGain(v_x, v_y) = (w0 + w1*shadows) / (w0 + w1);
+
+    Func lowGainClamped = Halide::BoundaryConditions::repeat_edge(lowGain, { { 0, lowWidth }, { 0, lowHeight } } );
+
+    lowGainX(v_x, v_y) =
+        (lowGainClamped(v_x - 2, v_y) + 4*lowGainClamped(v_x - 1, v_y) + 6*lowGainClamped(v_x, v_y) + 4*lowGainClamped(v_x + 1, v_y) + lowGainClamped(v_x + 2, v_y)) / 16;
+
+    lowGainBlurred(v_x, v_y) =
+        (lowGainX(v_x, v_y - 2) + 4*lowGainX(v_x, v_y - 1) + 6*lowGainX(v_x, v_y) + 4*lowGainX(v_x, v_y + 1) + lowGainX(v_x, v_y + 2)) / 16;
+
+    Func G = Halide::BoundaryConditions::repeat_edge(lowGainBlurred, { { 0, lowWidth }, { 0, lowHeight } } );
+
+    Expr gx = (v_x + 0.5f) / g - 0.5f;
+    Expr gy = (v_y + 0.5f) / g - 0.5f;
+
+    Expr ix = cast<int>(floor(gx));
+    Expr iy = cast<int>(floor(gy));
+
+    Expr ax = gx - ix;
+    Expr ay = gy - iy;
+
+    gain(v_x, v_y) = lerp(lerp(G(ix, iy), G(ix + 1, iy), ax), lerp(G(ix, iy + 1), G(ix + 1, iy + 1), ax), ay);
+
+    linearRgb(rgb, srgbInput, downscaled, width, height);
+
+    // Same black/white point + contrast curve as EnhanceGenerator
+    {
+        Expr p = max(1e-05f, contrast);
+        Expr a = p*8.0f;
+        Expr b = p*4.0f;
+
+        Expr M = 1.0f / (1 + exp(b));
+        Expr N = 1.0f / (1 + exp(-a + b)) - M;
+
+        Expr i = v_i / 65535.0f;
+        Expr j = gamma(i);
+        Expr k = clamp(j - blackPoint, 0.0f, 1.0f) * (1.0f / (1.0f - blackPoint + 1e-5f));
+        Expr m = k / whitePoint;
+
+        Expr S = 1.0f / (1.0f + exp(-a*m + b));
+        Expr T = (S - M) / N;
+
+        contrastLut(v_i) = saturating_cast<uint16_t>(T*65535.0f+0.5f);
+    }
+
+    Expr tonemapped = saturating_cast<uint16_t>(rgb(v_x, v_y, v_c) * gain(v_x, v_y) * 65535.0f + 0.5f);
+
+    curve(v_x, v_y, v_c) = contrastLut(tonemapped) / 65535.0f;
+
+    Expr L = 0.299f*curve(v_x, v_y, 0) + 0.587f*curve(v_x, v_y, 1) + 0.114f*curve(v_x, v_y, 2);
+
+    finalRgb(v_x, v_y, v_c) = saturating_cast<uint8_t>((L + saturation*(curve(v_x, v_y, v_c) - L)) * 255.0f + 0.5f);
+
+    //
+    // Finalize output
+    //
+
+    Expr M, N;
+
+    switch(rotation) {
+        case 90:
+            M = width - v_y;
+            N = select(flipped, height - v_x, v_x);
+            break;
+
+        case -90:
+            M = v_y;
+            N = select(flipped, v_x, height - v_x);
+            break;
+
+        case 180:
+            M = v_x;
+            N = height - v_y;
+            break;
+
+        default:
+        case 0:
+            M = select(flipped, width - v_x, v_x);
+            N = v_y;
+            break;
+    }
+
+    output(v_x, v_y, v_c) =
+        select( v_c == 0, finalRgb(M, N, 0),
+                v_c == 1, finalRgb(M, N, 1),
+                v_c == 2, finalRgb(M, N, 2),
+                cast<uint8_t>(255));
+
+    // Output interleaved
+    output
+        .dim(0).set_stride(4)
+        .dim(2).set_stride(1);
+
+    input.set_estimates({ {0, 15000000} });
+    inShadingMap0.set_estimates({ {0, 17}, {0, 13} });
+    inShadingMap1.set_estimates({ {0, 17}, {0, 13} });
+    inShadingMap2.set_estimates({ {0, 17}, {0, 13} });
+    inShadingMap3.set_estimates({ {0, 17}, {0, 13} });
+    cameraToSrgb.set_estimates({ {0, 3}, {0, 3} });
+    width.set_estimate(1000);
+    height.set_estimate(750);
+    stride.set_estimate(5000);
+    pixelFormat.set_estimate(0);
+    sensorArrangement.set_estimate(0);
+    whiteLevel.set_estimate(1023);
+    shadows.set_estimate(4.0f);
+    whitePoint.set_estimate(1.0f);
+    tonemapVariance.set_estimate(0.25f);
+    blackPoint.set_estimate(0.0f);
+    exposure.set_estimate(0.0f);
+    contrast.set_estimate(0.5f);
+    saturation.set_estimate(1.0f);
+    flipped.set_estimate(false);
+
+    output.set_estimates({ {0, 1000}, {0, 750}, {0, 4} });
+
+    if(!auto_schedule)
+        schedule_for_cpu();
+}
+
+void FusedPreviewGenerator::schedule_for_cpu() {
+    int vector_size_u8 = natural_vector_size<uint8_t>();
+    int vector_size_f32 = natural_vector_size<float>();
+
+    // Only the gain grid and the LUT are computed outside the output tiles
+    lowBayer
+        .compute_root()
+        .bound(v_c, 0, 4)
+        .parallel(v_y);
+
+    lowBayer
+        .update()
+        .reorder(r.x, r.y, v_c, v_x, v_y)
+        .parallel(v_y)
+        .unroll(v_c);
+
+    lowGain
+        .compute_root()
+        .vectorize(v_x, vector_size_f32);
+
+    lowGainX
+        .compute_root()
+        .vectorize(v_x, vector_size_f32);
+
+    lowGainBlurred
+        .compute_root()
+        .vectorize(v_x, vector_size_f32);
+
+    contrastLut
+        .compute_root()
+        .vectorize(v_i, 8);
+
+    output
+        .compute_root()
+        .bound(v_c, 0, 4)
+        .reorder(v_c, v_x, v_y)
+        .tile(v_x, v_y, v_xo, v_yo, v_xi, v_yi, 64, 32)
+        .fuse(v_xo, v_yo, tile_idx)
+        .parallel(tile_idx)
+        .unroll(v_c)
+        .vectorize(v_xi, vector_size_u8);
+
+    // Stages that read more than one channel are stored per tile so no channel is computed twice
+    downscaled
+        .compute_at(output, tile_idx)
+        .reorder(v_c, v_x, v_y)
+        .unroll(v_c)
+        .vectorize(v_x, vector_size_f32);
+
+    srgbInput
+        .compute_at(output, tile_idx)
+        .bound_extent(v_c, 3)
+        .reorder(v_c, v_x, v_y)
+        .unroll(v_c)
+        .vectorize(v_x, vector_size_f32);
+
+    gain
+        .compute_at(output, tile_idx)
+        .vectorize(v_x, vector_size_f32);
+
+    curve
+        .compute_at(output, tile_idx)
+        .bound_extent(v_c, 3)
+        .reorder(v_c, v_x, v_y)
+        .unroll(v_c)
+        .vectorize(v_x, vector_size_f32);
+}
+
 class FastPreviewGenerator : public Halide::Generator<FastPreviewGenerator>, public PostProcessBase {
 public:
     Input<Buffer<uint8_t>> input{"input", 1};
@@ -2984,6 +3540,7 @@ public:
 
     Input<int>    whiteLevel{"whiteLevel"};
     Input<int[4]> blackLevel{"blackLevel"};
+    Input<float>  scale{"scale"};
 
     Output<Buffer<uint8_t>> output{"output", 2};
 
@@ -3027,7 +3584,7 @@ void FastPreviewGenerator::generate() {
 
     Expr S = (P - blackLevel[0]) / (whiteLevel - blackLevel[0]);
 
-    gammaCorrected(v_x, v_y) = gammaLut(cast<uint8_t>(clamp(S * 255.0f + 0.5f, 0, 255)));
+    gammaCorrected(v_x, v_y) = gammaLut(cast<uint8_t>(clamp(S * scale * 255.0f + 0.5f, 0, 255)));
 
     output(v_x, v_y) = select(
         rotation == 90,  gammaCorrected(width - v_y, v_x),
@@ -3043,6 +3600,7 @@ void FastPreviewGenerator::generate() {
     blackLevel.set_estimate(2, 64);
     blackLevel.set_estimate(3, 64);
     whiteLevel.set_estimate(1023);
+    scale.set_estimate(1.0f);
     sx.set_estimate(2);
     sy.set_estimate(2);
     stride.set_estimate(4000);
@@ -3382,7 +3940,14 @@ public:
 
     Input<int> sensorArrangement{"sensorArrangement"};
 
-    Output<Buffer<uint32_t>> histogram{"histogram", 1};
+    // Luminance followed by the red, green and blue histograms
+    Output<Buffer<uint32_t>> histogram{"histogram", 2};
+
+    // Clipped pixels in each raw channel
+    Output<Buffer<uint32_t>> clipped{"clipped", 1};
+
+    // 8-bit luminance the histogram was built from, used for face detection
+    Output<Buffer<uint8_t>> luma{"luma", 2};
 
     void generate();
 };
@@ -3437,23 +4002,50 @@ void MeasureImageGenerator::generate() {
 
     Expr L = 0.2989f*colorCorrected(v_x, v_y, 0) + 0.5870f*colorCorrected(v_x, v_y, 1) + 0.1140f*colorCorrected(v_x, v_y, 2);
 
-    result8u(v_x, v_y) = cast<uint8_t>(clamp(L * 255 + 0.5f, 0, 255));
+    Expr value = mux(v_c, { L, colorCorrected(v_x, v_y, 0), colorCorrected(v_x, v_y, 1), colorCorrected(v_x, v_y, 2) });
 
-    RDom r(0, w, 0, h);
+    result8u(v_x, v_y, v_c) = cast<uint8_t>(clamp(value * 255 + 0.5f, 0, 255));
 
-    histogram(v_i) = cast<uint32_t>(0);
-    histogram(result8u(r.x, r.y)) += cast<uint32_t>(1);
+    RDom r(0, w, 0, h, 0, 4);
+
+    histogram(v_i, v_c) = cast<uint32_t>(0);
+    histogram(result8u(r.x, r.y, r.z), r.z) += cast<uint32_t>(1);
+
+    RDom rc(0, w, 0, h);
+
+    clipped(v_c) = cast<uint32_t>(0);
+    clipped(v_c) += cast<uint32_t>(demosaicInput(rc.x, rc.y, v_c) >= whiteLevel);
+
+    luma(v_x, v_y) = result8u(v_x, v_y, 0);
 
     // Schedule
+    colorCorrected
+        .compute_at(result8u, v_y)
+        .reorder(v_x, v_c, v_y)
+        .unroll(v_c)
+        .vectorize(v_x, 8);
+
     result8u
         .compute_root()
-        .reorder(v_x, v_y)
+        .bound(v_c, 0, 4)
+        .reorder(v_x, v_c, v_y)
+        .unroll(v_c)
         .parallel(v_y)
         .vectorize(v_x, 8);
 
     histogram
+        .bound(v_c, 0, 4)
         .compute_root()
         .vectorize(v_i, 32);
+
+    clipped
+        .bound(v_c, 0, 4)
+        .compute_root();
+
+    luma
+        .compute_root()
+        .parallel(v_y)
+        .vectorize(v_x, 16);
 }
 
 //////////////
@@ -3615,6 +4207,158 @@ void HdrMaskGenerator::schedule_for_cpu(::Halide::Pipeline pipeline, ::Halide::T
 
 //////////////
 
+// Warps every bracket preview to the reference and combines their ghost maps in one pass. Also outputs the
+// percentage of ghosted pixels used to accept or reject the HDR merge.
+class HdrGhostMaskGenerator : public Halide::Generator<HdrGhostMaskGenerator>, public PostProcessBase {
+public:
+    // Size of the erosion window in pixels. hdr_mask uses 3 at full preview resolution.
+    GeneratorParam<int> erode_size{"erode_size", 3};
+
+    Input<Buffer<uint8_t>> reference{"reference", 2};
+    Input<Func[]> input{"input", 2};
+    Input<Func[]> warpMatrix{"warpMatrix", 2};
+
+    Input<int> width{"width"};
+    Input<int> height{"height"};
+
+    Input<float> c{"c"};
+
+    Output<Buffer<uint8_t>> outputGhost{"outputGhost", 2};
+    Output<Buffer<float>> outputError{"outputError", 0};
+
+    void generate();
+
+private:
+    Func saturated(Func in);
+    void warp(Func& output, const Func& in, const Func& m);
+
+    Func combined{"combined"};
+    Func ghostMask{"ghostMask"};
+    Func rowSum{"rowSum"};
+};
+
+Func HdrGhostMaskGenerator::saturated(Func in) {
+    Func result;
+    Expr f = cast<float>(in(v_x, v_y)) / 255.0f;
+
+    result(v_x, v_y) = exp(-c * (f - 1.0f) * (f - 1.0f)) > 0.05f;
+
+    return result;
+}
+
+void HdrGhostMaskGenerator::warp(Func& output, const Func& in, const Func& m) {
+    Func clamped = BoundaryConditions::repeat_edge(in, { {0, width}, {0, height} } );
+    Func inputF32{"inputF32"};
+
+    inputF32(v_x, v_y) = cast<float>(clamped(v_x, v_y));
+
+    Expr fx = m(0, 0)*v_x + m(1, 0)*v_y + m(2, 0);
+    Expr fy = m(0, 1)*v_x + m(1, 1)*v_y + m(2, 1);
+    Expr fw = m(0, 2)*v_x + m(1, 2)*v_y + m(2, 2);
+
+    fx = fx / fw;
+    fy = fy / fw;
+
+    Expr x = cast<int>(floor(fx));
+    Expr y = cast<int>(floor(fy));
+
+    Expr a = fx - x;
+    Expr b = fy - y;
+
+    Expr p0 = lerp(inputF32(x, y), inputF32(x + 1, y), a);
+    Expr p1 = lerp(inputF32(x, y + 1), inputF32(x + 1, y + 1), a);
+
+    output(v_x, v_y) = saturating_cast<uint8_t>(lerp(p0, p1, b) + 0.5f);
+}
+
+void HdrGhostMaskGenerator::generate() {
+    Func referenceSaturated = saturated(BoundaryConditions::repeat_edge(reference));
+
+    // A pixel is a ghost when it is saturated in the reference but not in the bracket or the other way around
+    Expr ghost = cast<uint8_t>(1);
+
+    for(int i = 0; i < input.size(); i++) {
+        Func w{"w" + std::to_string(i)};
+
+        warp(w, input.at(i), warpMatrix.at(i));
+
+        ghost = ghost & cast<uint8_t>(referenceSaturated(v_x, v_y) ^ saturated(w)(v_x, v_y));
+    }
+
+    combined(v_x, v_y) = ghost;
+
+    // Erode the same way as hdr_mask, with the window scaled to the resolution of the inputs
+    Func combinedClamped = BoundaryConditions::repeat_edge(combined, { {0, width}, {0, height} } );
+    Expr eroded = cast<uint8_t>(1);
+
+    const int erodeSize = erode_size;
+
+    for(int y = -erodeSize; y < 0; y++) {
+        for(int x = -erodeSize; x < 0; x++) {
+            eroded = eroded & combinedClamped(v_x + x, v_y + y);
+        }
+    }
+
+    ghostMask(v_x, v_y) = eroded;
+    outputGhost(v_x, v_y) = ghostMask(v_x, v_y);
+
+    // Error metric
+    RDom rx(0, width);
+    RDom ry(0, height);
+
+    Func total{"total"};
+
+    rowSum(v_y) = 0;
+    rowSum(v_y) += cast<int>(ghostMask(rx, v_y));
+
+    total() = 0;
+    total() += rowSum(ry);
+
+    outputError() = total() * 100.0f / (width * height);
+
+    c.set_estimate(16.0f);
+    width.set_estimate(2048);
+    height.set_estimate(1536);
+
+    reference.set_estimates({{0, 2048}, {0, 1536}});
+
+    for(size_t i = 0; i < input.size(); i++) {
+        input[i].set_estimates({{0, 2048}, {0, 1536}});
+        warpMatrix[i].set_estimates({{0, 3}, {0, 3}});
+    }
+
+    outputGhost.set_estimates({{0, 2048}, {0, 1536}});
+
+    if(!auto_schedule) {
+        int vector_size_u8 = natural_vector_size<uint8_t>();
+
+        ghostMask
+            .compute_root()
+            .split(v_y, v_yo, v_yi, 32)
+            .parallel(v_yo)
+            .vectorize(v_x, vector_size_u8);
+
+        combined
+            .compute_at(ghostMask, v_yo)
+            .vectorize(v_x, vector_size_u8);
+
+        outputGhost
+            .compute_root()
+            .parallel(v_y, 32)
+            .vectorize(v_x, vector_size_u8);
+
+        rowSum
+            .compute_root()
+            .parallel(v_y, 32);
+
+        rowSum
+            .update()
+            .parallel(v_y, 32);
+    }
+}
+
+//////////////
+
 class LinearImageGenerator : public Halide::Generator<LinearImageGenerator>, public PostProcessBase {
 public:
     Input<Buffer<uint16_t>> input0{"input0", 2};
@@ -3774,7 +4518,9 @@ HALIDE_REGISTER_GENERATOR(Demosaic, demosaic_generator)
 HALIDE_REGISTER_GENERATOR(TonemapGenerator, tonemap_generator)
 HALIDE_REGISTER_GENERATOR(EnhanceGenerator, enhance_generator)
 HALIDE_REGISTER_GENERATOR(PreviewGenerator, preview_generator)
+HALIDE_REGISTER_GENERATOR(FusedPreviewGenerator, fused_preview_generator)
 HALIDE_REGISTER_GENERATOR(HdrMaskGenerator, hdr_mask_generator)
+HALIDE_REGISTER_GENERATOR(HdrGhostMaskGenerator, hdr_ghost_mask_generator)
 HALIDE_REGISTER_GENERATOR(LinearImageGenerator, linear_image_generator)
 HALIDE_REGISTER_GENERATOR(BuildBayerGenerator, build_bayer_generator)
 HALIDE_REGISTER_GENERATOR(DeghostGenerator, deghost_generator)
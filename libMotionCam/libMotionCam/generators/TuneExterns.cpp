@@ -0,0 +1,20 @@
+#include <HalideRuntime.h>
+#include <HalideBuffer.h>
+
+#include <cstring>
+
+// Stand in for the defringe filter in ImageProcessor.cpp so pipelines that call it can be benchmarked on their own.
+// It is the same for every schedule so it doesn't change which one is fastest.
+extern "C" int extern_defringe(halide_buffer_t *in, int32_t width, int32_t height, halide_buffer_t *out) {
+    if (in->is_bounds_query()) {
+        std::memcpy(&in->dim, &out->dim, out->dimensions * sizeof(halide_dimension_t));
+    }
+    else {
+        Halide::Runtime::Buffer<uint16_t> inBuf(*in);
+        Halide::Runtime::Buffer<uint16_t> outBuf(*out);
+
+        outBuf.copy_from(inBuf);
+    }
+
+    return 0;
+}
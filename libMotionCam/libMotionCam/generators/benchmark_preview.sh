@@ -0,0 +1,83 @@
+#!/bin/bash
+set -euo pipefail
+
+#
+# Benchmarks the fused preview pipeline against the existing one on a single core.
+#
+# The input is a 12MP RAW10 frame (4000x3000) rendered at 1/4 scale (1000x750), the size used by
+# createPreview with a downscale factor of 2. The fused pipeline should stay under TARGET_MS.
+#
+# Usage:
+#   ./benchmark_preview.sh
+#
+
+HALIDE_PATH="../../thirdparty/halide"
+BENCHMARK_DIR="tmp/benchmark_preview"
+CXX=${CXX:-g++}
+TARGET_MS=${TARGET_MS:-5}
+
+if [ ! -d ${HALIDE_PATH} ]
+then
+    echo "Halide is missing. Run setupenv.sh first"
+    exit 1
+fi
+
+if [[ "$OSTYPE" == "darwin"* ]]; then
+	export DYLD_LIBRARY_PATH=${HALIDE_PATH}/lib
+else
+	export LD_LIBRARY_PATH=${HALIDE_PATH}/lib
+fi
+
+export HL_NUM_THREADS=1
+
+ARGS="input=random:0:[15000000] \
+	inShadingMap0=constant:1:[17,13] inShadingMap1=constant:1:[17,13] inShadingMap2=constant:1:[17,13] inShadingMap3=constant:1:[17,13] \
+	asShotVector_0=0.5 asShotVector_1=1 asShotVector_2=0.6 cameraToSrgb=identity:[3,3] \
+	width=1000 height=750 stride=5000 pixelFormat=0 sensorArrangement=0 \
+	blackLevel_0=64 blackLevel_1=64 blackLevel_2=64 blackLevel_3=64 whiteLevel=1023 \
+	shadows=4 whitePoint=1 tonemapVariance=0.25 blackPoint=0 exposure=0 contrast=0.5 \
+	saturation=1 flipped=false"
+
+# The fused preview has no blues/greens, sharpening or pop
+PREVIEW_ARGS="blues=1 greens=1 sharpen0=2 sharpen1=1 pop=1"
+
+# Builds a pipeline with the runtime and RunGen and prints the best time in milliseconds
+function benchmark() {
+	FN=$1
+	GENERATOR_NAME=$2
+	PARAMS=$3
+	EXTRA_ARGS=${4:-}
+
+	OUT=${BENCHMARK_DIR}/${FN}
+	mkdir -p ${OUT}
+
+	./tmp/postprocess_generator -g ${GENERATOR_NAME} -f ${FN} -e static_library,h,registration -o ${OUT} \
+		target=host ${PARAMS} > ${OUT}/generate.log 2>&1
+
+	${CXX} -std=c++17 -O2 -DHALIDE_NO_PNG -DHALIDE_NO_JPEG \
+		-I ${HALIDE_PATH}/include -I ${HALIDE_PATH}/share/tools -I ${OUT} \
+		${HALIDE_PATH}/share/tools/RunGenMain.cpp ${OUT}/${FN}.registration.cpp ${OUT}/${FN}.a \
+		-o ${OUT}/${FN}.rungen -lpthread -ldl > ${OUT}/build.log 2>&1
+
+	./${OUT}/${FN}.rungen ${ARGS} ${EXTRA_ARGS} --output_extents=[1000,750,4] --benchmarks=all --benchmark_min_time=1 > ${OUT}/benchmark.log 2>&1
+
+	grep "Benchmark for" ${OUT}/benchmark.log | sed 's/.*best case of \([0-9.e+-]*\) sec.*/\1/' | awk '{ printf "%.3f\n", $1 * 1000 }'
+}
+
+rm -rf ${BENCHMARK_DIR}
+mkdir -p tmp ${BENCHMARK_DIR}
+
+g++ PostProcessGenerator.cpp ${HALIDE_PATH}/share/tools/GenGen.cpp -g -o3 -std=c++17 -Wall -pedantic -I ${HALIDE_PATH}/include -L ${HALIDE_PATH}/lib -lHalide -lpthread -ldl -o ./tmp/postprocess_generator
+
+PREVIEW_MS=$(benchmark preview_landscape2 preview_generator "rotation=0 tonemap_levels=8 downscale_factor=2 enable_sharpen=true pop_radius=7" "${PREVIEW_ARGS}")
+FUSED_MS=$(benchmark fused_preview_landscape2 fused_preview_generator "rotation=0 downscale_factor=2 gain_scale=16")
+
+echo "preview_landscape2:       ${PREVIEW_MS} ms"
+echo "fused_preview_landscape2: ${FUSED_MS} ms"
+
+if awk "BEGIN { exit !(${FUSED_MS} < ${TARGET_MS}) }"; then
+	echo "fused preview is within ${TARGET_MS} ms"
+else
+	echo "fused preview is over ${TARGET_MS} ms"
+	exit 1
+fi
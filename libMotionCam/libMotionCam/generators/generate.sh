@@ -15,6 +15,8 @@ else
 	export LD_LIBRARY_PATH=${HALIDE_PATH}/lib
 fi
 
+source ./targets.sh
+
 rm -rf tmp
 mkdir -p tmp
 
@@ -26,42 +28,61 @@ function build_denoise() {
 	TARGET=$1
 	ARCH=$2
 	FLAGS="no_runtime"
+	MULTI_TARGET=$(multi_target ${TARGET} ${FLAGS})
 
 	echo "[$ARCH] Building measure_noise_generator"
 	./tmp/denoise_generator -g measure_noise_generator -f measure_noise -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
 
 	echo "[$ARCH] Building denoise_generator_5x5"
-	./tmp/denoise_generator -g denoise_generator -f fuse_denoise_5x5 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} window=5
+	./tmp/denoise_generator -g denoise_generator -f fuse_denoise_5x5 -e static_library,h -o ../halide/${ARCH} target=${MULTI_TARGET} $(tuned_flags fuse_denoise_5x5 ${ARCH}) window=5
 
 	echo "[$ARCH] Building denoise_generator_7x7"
-	./tmp/denoise_generator -g denoise_generator -f fuse_denoise_7x7 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} window=7
+	./tmp/denoise_generator -g denoise_generator -f fuse_denoise_7x7 -e static_library,h -o ../halide/${ARCH} target=${MULTI_TARGET} $(tuned_flags fuse_denoise_7x7 ${ARCH}) window=7
 
 	echo "[$ARCH] Building denoise_generator_11x11"
-	./tmp/denoise_generator -g denoise_generator -f fuse_denoise_11x11 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} window=11
+	./tmp/denoise_generator -g denoise_generator -f fuse_denoise_11x11 -e static_library,h -o ../halide/${ARCH} target=${MULTI_TARGET} $(tuned_flags fuse_denoise_11x11 ${ARCH}) window=11
 
 	echo "[$ARCH] Building forward_transform_generator"
-	./tmp/denoise_generator -g forward_transform_generator -f forward_transform -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} input.type=uint16 levels=4
+	./tmp/denoise_generator -g forward_transform_generator -f forward_transform -e static_library,h -o ../halide/${ARCH} target=${MULTI_TARGET} input.type=uint16 levels=4
 
 	echo "[$ARCH] Building fuse_image_generator"
 	./tmp/denoise_generator -g fuse_image_generator -f fuse_image -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} input.type=uint16 reference.size=4 reference.type=float32 intermediate.size=4 intermediate.type=float32
 
 	echo "[$ARCH] Building inverse_transform_generator"
-	./tmp/denoise_generator -g inverse_transform_generator -f inverse_transform -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} input.size=4
+	./tmp/denoise_generator -g inverse_transform_generator -f inverse_transform -e static_library,h -o ../halide/${ARCH} target=${MULTI_TARGET} input.size=4
 }
 
 function build_postprocess() {
 	TARGET=$1
 	ARCH=$2
 	FLAGS="no_runtime"
+	MULTI_TARGET=$(multi_target ${TARGET} ${FLAGS})
 
 	echo "[$ARCH] Building deghost_generator"
-	./tmp/postprocess_generator -g deghost_generator -f deghost -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} input.type=uint16 warpMatrix.type=float32 input.size=4 warpMatrix.size=4
+	./tmp/postprocess_generator -g deghost_generator -f deghost -e static_library,h -o ../halide/${ARCH} target=${MULTI_TARGET} $(tuned_flags deghost ${ARCH}) input.type=uint16 warpMatrix.type=float32 input.size=4 warpMatrix.size=4
+
+	# Shorter bracket lists get their own pipeline so they don't warp and merge copies of the last bracket
+	for N in 1 2 3; do
+		echo "[$ARCH] Building deghost_generator (${N} brackets)"
+		./tmp/postprocess_generator -g deghost_generator -f deghost${N} -e static_library,h -o ../halide/${ARCH} target=${MULTI_TARGET} $(tuned_flags deghost ${ARCH}) input.type=uint16 warpMatrix.type=float32 input.size=${N} warpMatrix.size=${N}
+	done
 
 	echo "[$ARCH] Building build_bayer_generator"
 	./tmp/postprocess_generator -g build_bayer_generator -f build_bayer -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
 
-	echo "[$ARCH] Building hdr_mask_generator"
-	./tmp/postprocess_generator -g hdr_mask_generator -f hdr_mask -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	# The ghost mask runs on previews at half the resolution hdr_mask_generator was used at. A 2x2 window erodes the
+	# same border as its 3x3 window.
+	echo "[$ARCH] Building hdr_ghost_mask_generator input.size=1"
+	./tmp/postprocess_generator -g hdr_ghost_mask_generator -f hdr_ghost_mask1 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} input.type=uint8 warpMatrix.type=float32 input.size=1 warpMatrix.size=1 erode_size=2
+
+	echo "[$ARCH] Building hdr_ghost_mask_generator input.size=2"
+	./tmp/postprocess_generator -g hdr_ghost_mask_generator -f hdr_ghost_mask2 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} input.type=uint8 warpMatrix.type=float32 input.size=2 warpMatrix.size=2 erode_size=2
+
+	echo "[$ARCH] Building hdr_ghost_mask_generator input.size=3"
+	./tmp/postprocess_generator -g hdr_ghost_mask_generator -f hdr_ghost_mask3 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} input.type=uint8 warpMatrix.type=float32 input.size=3 warpMatrix.size=3 erode_size=2
+
+	echo "[$ARCH] Building hdr_ghost_mask_generator input.size=4"
+	./tmp/postprocess_generator -g hdr_ghost_mask_generator -f hdr_ghost_mask4 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} input.type=uint8 warpMatrix.type=float32 input.size=4 warpMatrix.size=4 erode_size=2
 
 	echo "[$ARCH] Building linear_image_generator"
 	./tmp/postprocess_generator -g linear_image_generator -f linear_image -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
@@ -76,11 +97,32 @@ function build_postprocess() {
 	./tmp/postprocess_generator -g deinterleave_raw_generator -f deinterleave_raw -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
 
 	echo "[$ARCH] Building postprocess_generator"
-	./tmp/postprocess_generator -g postprocess_generator -f postprocess -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	./tmp/postprocess_generator -g postprocess_generator -f postprocess -e static_library,h -o ../halide/${ARCH} target=${MULTI_TARGET} $(tuned_flags postprocess ${ARCH})
+
+	echo "[$ARCH] Building postprocess_generator enable_hdr=false"
+	./tmp/postprocess_generator -g postprocess_generator -f postprocess_nohdr -e static_library,h -o ../halide/${ARCH} target=${MULTI_TARGET} $(tuned_flags postprocess_nohdr ${ARCH}) enable_hdr=false
+
+	echo "[$ARCH] Building postprocess_generator output_type=uint16"
+	./tmp/postprocess_generator -g postprocess_generator -f postprocess16 -e static_library,h -o ../halide/${ARCH} target=${MULTI_TARGET} $(tuned_flags postprocess16 ${ARCH}) output_type=uint16
+
+	echo "[$ARCH] Building postprocess_generator output_type=uint16 enable_hdr=false"
+	./tmp/postprocess_generator -g postprocess_generator -f postprocess16_nohdr -e static_library,h -o ../halide/${ARCH} target=${MULTI_TARGET} $(tuned_flags postprocess16_nohdr ${ARCH}) output_type=uint16 enable_hdr=false
 
 	echo "[$ARCH] Building fast_preview_generator"
 	./tmp/postprocess_generator -g fast_preview_generator -f fast_preview -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
 
+	echo "[$ARCH] Building preview_generator1 rotation=0"
+	./tmp/postprocess_generator -g preview_generator -f preview_landscape1 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=0 tonemap_levels=9 downscale_factor=1 enable_sharpen=true pop_radius=15
+
+	echo "[$ARCH] Building preview_generator1 rotation=90"
+	./tmp/postprocess_generator -g preview_generator -f preview_reverse_portrait1 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=90 tonemap_levels=9 downscale_factor=1 enable_sharpen=true pop_radius=15
+
+	echo "[$ARCH] Building preview_generator1 rotation=-90"
+	./tmp/postprocess_generator -g preview_generator -f preview_portrait1 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=-90 tonemap_levels=9 downscale_factor=1 enable_sharpen=true pop_radius=15
+
+	echo "[$ARCH] Building preview_generator1 rotation=180"
+	./tmp/postprocess_generator -g preview_generator -f preview_reverse_landscape1 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=180 tonemap_levels=9 downscale_factor=1 enable_sharpen=true pop_radius=15
+
 	echo "[$ARCH] Building preview_generator2 rotation=0"
 	./tmp/postprocess_generator -g preview_generator -f preview_landscape2 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=0 tonemap_levels=8 downscale_factor=2 enable_sharpen=true pop_radius=7
 
@@ -116,6 +158,54 @@ function build_postprocess() {
 
 	echo "[$ARCH] Building preview_generator8 rotation=180"
 	./tmp/postprocess_generator -g preview_generator -f preview_reverse_landscape8 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=180 tonemap_levels=4 downscale_factor=8 enable_sharpen=false
+
+	echo "[$ARCH] Building fused_preview_generator1 rotation=0"
+	./tmp/postprocess_generator -g fused_preview_generator -f fused_preview_landscape1 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=0 downscale_factor=1 gain_scale=32
+
+	echo "[$ARCH] Building fused_preview_generator1 rotation=90"
+	./tmp/postprocess_generator -g fused_preview_generator -f fused_preview_reverse_portrait1 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=90 downscale_factor=1 gain_scale=32
+
+	echo "[$ARCH] Building fused_preview_generator1 rotation=-90"
+	./tmp/postprocess_generator -g fused_preview_generator -f fused_preview_portrait1 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=-90 downscale_factor=1 gain_scale=32
+
+	echo "[$ARCH] Building fused_preview_generator1 rotation=180"
+	./tmp/postprocess_generator -g fused_preview_generator -f fused_preview_reverse_landscape1 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=180 downscale_factor=1 gain_scale=32
+
+	echo "[$ARCH] Building fused_preview_generator2 rotation=0"
+	./tmp/postprocess_generator -g fused_preview_generator -f fused_preview_landscape2 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=0 downscale_factor=2 gain_scale=16
+
+	echo "[$ARCH] Building fused_preview_generator2 rotation=90"
+	./tmp/postprocess_generator -g fused_preview_generator -f fused_preview_reverse_portrait2 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=90 downscale_factor=2 gain_scale=16
+
+	echo "[$ARCH] Building fused_preview_generator2 rotation=-90"
+	./tmp/postprocess_generator -g fused_preview_generator -f fused_preview_portrait2 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=-90 downscale_factor=2 gain_scale=16
+
+	echo "[$ARCH] Building fused_preview_generator2 rotation=180"
+	./tmp/postprocess_generator -g fused_preview_generator -f fused_preview_reverse_landscape2 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=180 downscale_factor=2 gain_scale=16
+
+	echo "[$ARCH] Building fused_preview_generator4 rotation=0"
+	./tmp/postprocess_generator -g fused_preview_generator -f fused_preview_landscape4 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=0 downscale_factor=4 gain_scale=8
+
+	echo "[$ARCH] Building fused_preview_generator4 rotation=90"
+	./tmp/postprocess_generator -g fused_preview_generator -f fused_preview_reverse_portrait4 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=90 downscale_factor=4 gain_scale=8
+
+	echo "[$ARCH] Building fused_preview_generator4 rotation=-90"
+	./tmp/postprocess_generator -g fused_preview_generator -f fused_preview_portrait4 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=-90 downscale_factor=4 gain_scale=8
+
+	echo "[$ARCH] Building fused_preview_generator4 rotation=180"
+	./tmp/postprocess_generator -g fused_preview_generator -f fused_preview_reverse_landscape4 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=180 downscale_factor=4 gain_scale=8
+
+	echo "[$ARCH] Building fused_preview_generator8 rotation=0"
+	./tmp/postprocess_generator -g fused_preview_generator -f fused_preview_landscape8 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=0 downscale_factor=8 gain_scale=4
+
+	echo "[$ARCH] Building fused_preview_generator8 rotation=90"
+	./tmp/postprocess_generator -g fused_preview_generator -f fused_preview_reverse_portrait8 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=90 downscale_factor=8 gain_scale=4
+
+	echo "[$ARCH] Building fused_preview_generator8 rotation=-90"
+	./tmp/postprocess_generator -g fused_preview_generator -f fused_preview_portrait8 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=-90 downscale_factor=8 gain_scale=4
+
+	echo "[$ARCH] Building fused_preview_generator8 rotation=180"
+	./tmp/postprocess_generator -g fused_preview_generator -f fused_preview_reverse_landscape8 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} rotation=180 downscale_factor=8 gain_scale=4
 }
 
 function build_camera_preview() {
@@ -145,7 +235,7 @@ function build_camera_preview() {
 }
 
 function build_runtime() {
-	TARGET=$1
+	TARGET=$(runtime_target $1)
 	ARCH=$2
 
 	echo "[$ARCH] Building halide_runtime_base"
@@ -0,0 +1,59 @@
+#!/bin/bash
+
+#
+# Targets and tuned schedules shared by generate.sh and tune.sh, so the pipelines are benchmarked with the same
+# target string and autoscheduler settings they are built with.
+#
+
+# Fixed autoscheduler search parameters. The flags saved by tune.sh only reproduce the benchmarked schedule
+# when generate.sh runs the autoscheduler with the same values.
+export HL_RANDOM_DROPOUT=100
+export HL_BEAM_SIZE=32
+export HL_SEED=0
+
+function host_os() {
+	if [[ "$OSTYPE" == "darwin"* ]]; then
+		echo "osx"
+	else
+		echo "linux"
+	fi
+}
+
+# Heavy pipelines are built for several ISAs on x86-64 hosts. Halide adds a wrapper that picks the
+# fastest one the CPU supports at runtime, the last target is the fallback.
+function multi_target() {
+	TARGET=$1
+	FLAGS=${2:-}
+	SUFFIX=${FLAGS:+-${FLAGS}}
+
+	if [[ "${TARGET}" == "host" && "$(uname -m)" == "x86_64" ]]; then
+		OS=$(host_os)
+
+		echo "x86-64-${OS}-avx512_skylake${SUFFIX},x86-64-${OS}-avx2-fma-f16c-sse41${SUFFIX},x86-64-${OS}-sse41${SUFFIX}"
+	else
+		echo "${TARGET}${SUFFIX}"
+	fi
+}
+
+# The runtime is shared by all the pipelines, so on x86-64 hosts it is built for the fallback target
+# of multi_target. Building it for the host would require the CPU features of the build machine.
+function runtime_target() {
+	TARGET=$1
+
+	if [[ "${TARGET}" == "host" && "$(uname -m)" == "x86_64" ]]; then
+		echo "x86-64-$(host_os)-sse41"
+	else
+		echo "${TARGET}"
+	fi
+}
+
+# Autoscheduler flags for pipelines where tune.sh found a faster schedule than the hand written one. The
+# schedule it generated is kept next to them in schedules/ARCH/<function>*.schedule.h for review.
+function tuned_flags() {
+	FN=$1
+	ARCH=$2
+
+	if [ -f schedules/${ARCH}/${FN}.txt ]; then
+		cat schedules/${ARCH}/${FN}.txt
+	fi
+}
@@ -0,0 +1,159 @@
+#!/bin/bash
+set -euo pipefail
+
+#
+# Tunes the schedules of the heavy pipelines for one target.
+#
+# Each pipeline is built with its hand written schedule and with each autoscheduler, then benchmarked on the
+# input sizes given by the generator estimates. Candidates are built for the same target string as generate.sh,
+# so on x86-64 hosts the benchmark runs the variant the multi-target wrapper picks for this CPU. The arguments of
+# the fastest build are saved to schedules/ARCH/<function>.txt, which generate.sh picks up, together with the
+# generated schedules. Commit both after tuning.
+#
+# Usage:
+#   ./tune.sh host host
+#   CXX=<ndk clang++> ./tune.sh arm-64-android arm64-v8a      (benchmarks run on a device connected with adb)
+#
+# Set PIPELINES to tune a subset, e.g. PIPELINES="fuse_denoise_7x7 postprocess" ./tune.sh host host
+#
+
+TARGET=$1
+ARCH=$2
+
+HALIDE_PATH="../../thirdparty/halide"
+TUNE_DIR="tmp/tune/${ARCH}"
+SCHEDULE_DIR="schedules/${ARCH}"
+CXX=${CXX:-g++}
+
+if [ ! -d ${HALIDE_PATH} ]
+then
+    echo "Halide is missing. Run setupenv.sh first"
+    exit 1
+fi
+
+if [[ "$OSTYPE" == "darwin"* ]]; then
+	export DYLD_LIBRARY_PATH=${HALIDE_PATH}/lib
+	PLUGIN_EXT="dylib"
+	NUM_CORES=$(sysctl -n hw.ncpu)
+else
+	export LD_LIBRARY_PATH=${HALIDE_PATH}/lib
+	PLUGIN_EXT="so"
+	NUM_CORES=$(nproc)
+fi
+
+source ./targets.sh
+
+# Same target string as generate.sh. The candidates keep the runtime since RunGen links them on their own.
+TUNE_TARGET=$(multi_target ${TARGET})
+
+# Parallelism, last level cache size and balance used by the cost models. Override for the device when tuning
+# for Android.
+MACHINE_PARAMS=${MACHINE_PARAMS:-"${NUM_CORES},16777216,40"}
+
+AUTOSCHEDULERS="Adams2019 Li2018"
+
+# function generator generator_name params
+ALL_PIPELINES=(
+	"fuse_denoise_5x5 denoise_generator denoise_generator window=5"
+	"fuse_denoise_7x7 denoise_generator denoise_generator window=7"
+	"fuse_denoise_11x11 denoise_generator denoise_generator window=11"
+	"deghost postprocess_generator deghost_generator input.type=uint16 warpMatrix.type=float32 input.size=4 warpMatrix.size=4"
+	"postprocess postprocess_generator postprocess_generator"
+	"postprocess_nohdr postprocess_generator postprocess_generator enable_hdr=false"
+	"postprocess16 postprocess_generator postprocess_generator output_type=uint16"
+	"postprocess16_nohdr postprocess_generator postprocess_generator output_type=uint16 enable_hdr=false"
+)
+
+PIPELINES=${PIPELINES:-""}
+
+function autoscheduler_flags() {
+	NAME=$1
+	LIB=$(echo ${NAME} | tr '[:upper:]' '[:lower:]')
+
+	echo "-p ${HALIDE_PATH}/lib/libautoschedule_${LIB}.${PLUGIN_EXT} -s ${NAME} auto_schedule=true machine_params=${MACHINE_PARAMS}"
+}
+
+function run_benchmark() {
+	BINARY=$1
+
+	if [[ "${ARCH}" == "host" ]]; then
+		./${BINARY} --estimate_all --benchmarks=all --benchmark_min_time=1 2>&1
+	else
+		adb push ${BINARY} /data/local/tmp/ > /dev/null
+		adb shell /data/local/tmp/$(basename ${BINARY}) --estimate_all --benchmarks=all --benchmark_min_time=1 2>&1
+	fi
+}
+
+# Builds a candidate with the runtime and RunGen and prints the best time in seconds
+function benchmark() {
+	FN=$1
+	GENERATOR=$2
+	GENERATOR_NAME=$3
+	CANDIDATE=$4
+	FLAGS=$5
+	PARAMS=$6
+
+	OUT=${TUNE_DIR}/${FN}/${CANDIDATE}
+	mkdir -p ${OUT}
+
+	./tmp/${GENERATOR} -g ${GENERATOR_NAME} -f ${FN} -e static_library,h,registration,schedule -o ${OUT} \
+		target=${TUNE_TARGET} ${FLAGS} ${PARAMS} > ${OUT}/generate.log 2>&1
+
+	${CXX} -std=c++17 -O2 -DHALIDE_NO_PNG -DHALIDE_NO_JPEG \
+		-I ${HALIDE_PATH}/include -I ${HALIDE_PATH}/share/tools -I ${OUT} \
+		${HALIDE_PATH}/share/tools/RunGenMain.cpp ${OUT}/${FN}.registration.cpp ${OUT}/${FN}.a TuneExterns.cpp \
+		-o ${OUT}/${FN}.rungen -lpthread -ldl > ${OUT}/build.log 2>&1
+
+	run_benchmark ${OUT}/${FN}.rungen > ${OUT}/benchmark.log
+
+	grep "Benchmark for" ${OUT}/benchmark.log | sed 's/.*best case of \([0-9.e+-]*\) sec.*/\1/'
+}
+
+rm -rf ${TUNE_DIR}
+mkdir -p tmp ${TUNE_DIR} ${SCHEDULE_DIR}
+
+g++ DenoiseGenerator.cpp ${HALIDE_PATH}/share/tools/GenGen.cpp -g -o3 -std=c++17 -Wall -pedantic -I ${HALIDE_PATH}/include -L ${HALIDE_PATH}/lib -lHalide -lpthread -ldl -o ./tmp/denoise_generator
+g++ PostProcessGenerator.cpp ${HALIDE_PATH}/share/tools/GenGen.cpp -g -o3 -std=c++17 -Wall -pedantic -I ${HALIDE_PATH}/include -L ${HALIDE_PATH}/lib -lHalide -lpthread -ldl -o ./tmp/postprocess_generator
+
+for PIPELINE in "${ALL_PIPELINES[@]}"; do
+	read -r FN GENERATOR GENERATOR_NAME PARAMS <<< "${PIPELINE}"
+
+	if [[ -n "${PIPELINES}" && " ${PIPELINES} " != *" ${FN} "* ]]; then
+		continue
+	fi
+
+	echo "[$ARCH] Tuning ${FN}"
+
+	BEST_CANDIDATE="manual"
+	BEST_FLAGS=""
+	BEST_TIME=$(benchmark ${FN} ${GENERATOR} ${GENERATOR_NAME} manual "" "${PARAMS}" || echo "")
+
+	echo "[$ARCH]   manual: ${BEST_TIME:-failed}"
+
+	for SCHEDULER in ${AUTOSCHEDULERS}; do
+		FLAGS=$(autoscheduler_flags ${SCHEDULER})
+		TIME=$(benchmark ${FN} ${GENERATOR} ${GENERATOR_NAME} ${SCHEDULER} "${FLAGS}" "${PARAMS}" || echo "")
+
+		echo "[$ARCH]   ${SCHEDULER}: ${TIME:-failed}"
+
+		if [[ -n "${TIME}" ]] && { [[ -z "${BEST_TIME}" ]] || awk "BEGIN { exit !(${TIME} < ${BEST_TIME}) }"; }; then
+			BEST_CANDIDATE=${SCHEDULER}
+			BEST_FLAGS=${FLAGS}
+			BEST_TIME=${TIME}
+		fi
+	done
+
+	echo "[$ARCH]   using ${BEST_CANDIDATE}"
+
+	# The hand written schedule needs no extra flags
+	if [[ "${BEST_CANDIDATE}" == "manual" ]]; then
+		rm -f ${SCHEDULE_DIR}/${FN}.txt ${SCHEDULE_DIR}/${FN}.schedule.h ${SCHEDULE_DIR}/${FN}-*.schedule.h
+	else
+		echo "${BEST_FLAGS}" > ${SCHEDULE_DIR}/${FN}.txt
+		cp ${TUNE_DIR}/${FN}/${BEST_CANDIDATE}/${FN}*.schedule.h ${SCHEDULE_DIR}/
+	fi
+
+	echo "${FN} ${BEST_CANDIDATE} ${BEST_TIME:-failed}" >> ${TUNE_DIR}/results.txt
+done
+
+cat ${TUNE_DIR}/results.txt
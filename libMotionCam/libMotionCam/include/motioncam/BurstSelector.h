@@ -0,0 +1,30 @@
+#ifndef BurstSelector_hpp
+#define BurstSelector_hpp
+
+#include <vector>
+#include <memory>
+
+namespace motioncam {
+    struct RawImageBuffer;
+    struct RawCameraMetadata;
+    class RawContainer;
+
+    // Picks the frames of a burst worth merging. Each candidate is scored by how close its exposure is to the
+    // reference, how sharp it is and how much it moved, all from the low resolution image statistics. The best
+    // candidates are added until the merged noise reaches a target, so bright scenes keep only a few frames.
+    class BurstSelector {
+    public:
+        // Candidates should be ordered by preference when the scores are equal, e.g. closest to the reference first.
+        // Returns the reference followed by the selected candidates.
+        static std::vector<std::shared_ptr<RawImageBuffer>> select(
+            const RawCameraMetadata& cameraMetadata,
+            const std::shared_ptr<RawImageBuffer>& reference,
+            const std::vector<std::shared_ptr<RawImageBuffer>>& candidates);
+
+        // Removes the frames not worth merging from the container, scoring the frames closest to the reference first.
+        // Frames are loaded one at a time to measure their statistics and released again unless already loaded.
+        static void filter(RawContainer& rawContainer);
+    };
+}
+
+#endif /* BurstSelector_hpp */
@@ -11,6 +11,9 @@ namespace motioncam {
         virtual bool onProgressUpdate(int progress) const = 0;
         virtual void onCompleted() const = 0;
         virtual void onError(const std::string& error) const = 0;
+
+        // Periodic throughput and per-stage timings as a JSON object
+        virtual void onStats(const std::string& stats) const {}
     };
 }
 
@@ -0,0 +1,36 @@
+#ifndef FaceDetector_hpp
+#define FaceDetector_hpp
+
+#include <opencv2/opencv.hpp>
+
+#include <vector>
+#include <mutex>
+
+namespace motioncam {
+    struct RawImageBuffer;
+    struct RawCameraMetadata;
+
+    // Detects faces on the luminance pyramid kept with the image statistics, so no extra preview has to be rendered.
+    // Faces found in the previous frame are tracked by searching around them on the pyramid level that matches their
+    // size, with a full search of the finest level every few frames to pick up new faces.
+    // Faces are returned normalised to [0, 1] in screen orientation.
+    class FaceDetector {
+    public:
+        FaceDetector(const int fullSearchInterval=8);
+
+        std::vector<cv::Rect2f> detect(const RawImageBuffer& buffer, const RawCameraMetadata& cameraMetadata);
+        void reset();
+
+    private:
+        std::vector<cv::Rect2f> search(const std::vector<cv::Mat>& pyramid) const;
+        std::vector<cv::Rect2f> track(const std::vector<cv::Mat>& pyramid) const;
+
+    private:
+        std::mutex mLock;
+        int mFullSearchInterval;
+        int mFramesSinceFullSearch;
+        std::vector<cv::Rect2f> mFaces;
+    };
+}
+
+#endif /* FaceDetector_hpp */
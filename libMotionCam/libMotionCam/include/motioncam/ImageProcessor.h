@@ -19,6 +19,26 @@ namespace motioncam {
     struct HdrMetadata;
     struct PreviewMetadata;
     
+    // How features are paired when registering images
+    enum class FeatureMatcher : int {
+        BRUTE_FORCE = 0,
+        LSH
+    };
+
+    // Keypoints and descriptors of an image. Computed once for the reference and reused for every image aligned to it.
+    struct RegistrationFeatures {
+        std::vector<cv::KeyPoint> keypoints;
+        cv::Mat descriptors;
+    };
+
+    // Smoothed pyramid of an image and its gradients for ECC registration. Built once for the reference and shared by
+    // every image aligned to it. Level 0 is left empty since registration stops at level 1.
+    struct RegistrationPyramid {
+        std::vector<cv::Mat> images;
+        std::vector<cv::Mat> gradientX;
+        std::vector<cv::Mat> gradientY;
+    };
+
     class ImageProgressHelper {
     public:
         ImageProgressHelper(const ImageProcessorProgress& progressListener, int numImages, int start);
@@ -44,11 +64,17 @@ namespace motioncam {
 
         static void process(RawContainer& rawContainer, const std::string& outputPath, const ImageProcessorProgress& progressListener);
 
+        // Fast previews use a single pass pipeline with a simpler tonemap and no sharpening, pop or blues/greens
         static Halide::Runtime::Buffer<uint8_t> createPreview(const RawImageBuffer& rawBuffer,
                                                        const int downscaleFactor,
                                                        const RawCameraMetadata& cameraMetadata,
-                                                       const PostProcessSettings& settings);
+                                                       const PostProcessSettings& settings,
+                                                       const bool fast=false);
         
+        static std::shared_ptr<ImageStatistics> measureStatistics(const RawCameraMetadata& cameraMetadata,
+                                                                  const RawImageBuffer& rawBuffer,
+                                                                  const int downscale=4);
+
         static cv::Mat calcHistogram(const RawCameraMetadata& cameraMetadata,
                                      const RawImageBuffer& reference,
                                      const bool cumulative,
@@ -79,16 +105,43 @@ namespace motioncam {
         static cv::Mat registerImage(const Halide::Runtime::Buffer<uint8_t>& referenceBuffer,
                                      const Halide::Runtime::Buffer<uint8_t>& toAlignBuffer);
 
+        static void detectFeatures(const Halide::Runtime::Buffer<uint8_t>& buffer, RegistrationFeatures& outFeatures);
+
+        static cv::Mat registerImage(const RegistrationFeatures& reference,
+                                     const Halide::Runtime::Buffer<uint8_t>& toAlignBuffer,
+                                     const FeatureMatcher matcher=FeatureMatcher::BRUTE_FORCE);
+
         static cv::Mat registerImage2(const Halide::Runtime::Buffer<uint8_t>& referenceBuffer,
                                       const Halide::Runtime::Buffer<uint8_t>& toAlignBuffer);
 
+        static void buildRegistrationPyramid(const Halide::Runtime::Buffer<uint8_t>& buffer, RegistrationPyramid& outPyramid);
+
+        static cv::Mat registerImage2(const RegistrationPyramid& reference,
+                                      const Halide::Runtime::Buffer<uint8_t>& toAlignBuffer);
+
+        // Registers all images against the reference in parallel. Empty matrices are returned for images that failed.
+        static std::vector<cv::Mat> registerImages2(const Halide::Runtime::Buffer<uint8_t>& referenceBuffer,
+                                                    const std::vector<Halide::Runtime::Buffer<uint8_t>>& toAlignBuffers);
+
         static void matchExposures(
             const RawCameraMetadata& cameraMetadata, const RawImageBuffer& reference, const RawImageBuffer& toMatch, float& outScale, float& outWhitePoint);
 
+        // Scale and white point of each bracket relative to the reference, the brackets are matched concurrently
+        static void matchExposures(const RawCameraMetadata& cameraMetadata,
+                                   const RawImageBuffer& reference,
+                                   const std::vector<std::shared_ptr<RawImageBuffer>>& toMatch,
+                                   std::vector<float>& outScales,
+                                   std::vector<float>& outWhitePoints);
+
         static std::shared_ptr<RawData> loadRawImage(const RawImageBuffer& rawImage,
                                                      const RawCameraMetadata& cameraMetadata,
                                                      const bool extendEdges=true,
                                                      const float scalePreview=1.0f);
+
+        static Halide::Runtime::Buffer<uint8_t> loadPreviewImage(const RawImageBuffer& rawImage,
+                                                                 const RawCameraMetadata& cameraMetadata,
+                                                                 const int downscale,
+                                                                 const float scalePreview=1.0f);
         
         static void createSrgbMatrix(const RawCameraMetadata& cameraMetadata,
                                      const RawImageMetadata& rawImageMetadata,
@@ -110,11 +163,12 @@ namespace motioncam {
             float* outNoise,
             ImageProgressHelper& progressHelper);
         
-        static void addExifMetadata(const RawImageMetadata& metadata,
-                                    const cv::Mat& thumbnail,
-                                    const RawCameraMetadata& cameraMetadata,
-                                    const PostProcessSettings& settings,
-                                    const std::string& inputOutput);
+        // Encodes the exif data in TIFF format so it can be written with the image
+        static void createExifData(const RawImageMetadata& metadata,
+                                   const cv::Mat& thumbnail,
+                                   const RawCameraMetadata& cameraMetadata,
+                                   const PostProcessSettings& settings,
+                                   std::vector<uint8_t>& outExifData);
 
         static cv::Mat postProcess(std::vector<Halide::Runtime::Buffer<uint16_t>>& inputBuffers,
                                    const std::shared_ptr<HdrMetadata>& hdrMetadata,
@@ -123,12 +177,14 @@ namespace motioncam {
                                    float noiseEstimate,
                                    const RawImageMetadata& metadata,
                                    const RawCameraMetadata& cameraMetadata,
-                                   const PostProcessSettings& settings);
+                                   const PostProcessSettings& settings,
+                                   const int outputType=CV_8UC3);
 
         static std::shared_ptr<HdrMetadata> prepareHdr(const RawCameraMetadata& cameraMetadata,
                                                        const PostProcessSettings& settings,
                                                        const RawImageBuffer& reference,
-                                                       const std::vector<std::shared_ptr<RawImageBuffer>>& underexposed);
+                                                       const std::vector<std::shared_ptr<RawImageBuffer>>& underexposed,
+                                                       const FeatureMatcher matcher=FeatureMatcher::LSH);
         
         static double calcEv(const RawCameraMetadata& cameraMetadata, const RawImageMetadata& metadata);
 
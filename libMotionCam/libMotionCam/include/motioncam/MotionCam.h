@@ -2,6 +2,7 @@
 #define MotionCam_hpp
 
 #include <string>
+#include <iosfwd>
 
 #include "motioncam/ImageProcessorProgress.h"
 #include "motioncam/DngProcessorProgress.h"
@@ -9,7 +10,67 @@
 namespace motioncam {
     class RawContainer;
 
-    float ConvertVideoToDNG(const std::string& containerPath, const DngProcessorProgress& progress, const int numThreads=4);
+    struct DngExportOptions {
+        DngExportOptions() :
+            startFrame(0),
+            endFrame(-1),
+            frameStride(1),
+            cropX(0),
+            cropY(0),
+            cropWidth(0),
+            cropHeight(0)
+        {
+        }
+        
+        // Inclusive range of frames to export, in timestamp order. A negative end exports to the last frame.
+        int startFrame;
+        int endFrame;
+        
+        // Export every Nth frame of the range
+        int frameStride;
+        
+        // Region of the sensor to export, aligned to the bayer pattern. Zero width/height exports the full frame.
+        int cropX;
+        int cropY;
+        int cropWidth;
+        int cropHeight;
+    };
+
+    float ConvertVideoToDNG(const std::string& containerPath,
+                            const DngProcessorProgress& progress,
+                            const int numThreads=4,
+                            const DngExportOptions& options=DngExportOptions());
+
+    // Writes each frame as outputPath/frameNNNN.dng instead of into the zip archives returned by onNeedFd()
+    float ConvertVideoToDNG(const std::string& containerPath,
+                            const std::string& outputPath,
+                            const DngProcessorProgress& progress,
+                            const int numThreads=4,
+                            const DngExportOptions& options=DngExportOptions());
+
+    enum class ProxyFormat : int {
+        JPEG_SEQUENCE = 0,
+        Y4M
+    };
+
+    // Renders each frame through the camera preview pipeline for quick editing proxies. The downscale factor is relative
+    // to the half resolution RAW and must be 1, 2, 4 or 8. JPEG_SEQUENCE writes outputPath/frameNNNN.jpg, Y4M writes a single
+    // 4:2:0 stream to outputPath. Only the frame range and stride of the export options are used.
+    // fastPreview renders with the lower quality single pass preview, see ImageProcessor::createPreview().
+    float ConvertVideoToProxy(const std::string& containerPath,
+                              const std::string& outputPath,
+                              const DngProcessorProgress& progress,
+                              const ProxyFormat format=ProxyFormat::JPEG_SEQUENCE,
+                              const int downscaleFactor=2,
+                              const int numThreads=4,
+                              const DngExportOptions& options=DngExportOptions(),
+                              const bool fastPreview=false);
+
+    // Runs the live preview settings estimator over the frames in timestamp order and writes the estimate after each
+    // frame to output as a line of JSON. Only the frame range and stride of the export options are used.
+    void EstimateVideoSettings(const std::string& containerPath,
+                               std::ostream& output,
+                               const DngExportOptions& options=DngExportOptions());
 
     void ProcessImage(RawContainer& rawContainer, const std::string& outputFilePath, const ImageProcessorProgress& progressListener);
     void ProcessImage(const std::string& containerPath, const std::string& outputFilePath, const ImageProcessorProgress& progressListener);
@@ -6,6 +6,7 @@
 
 #include <string>
 #include <vector>
+#include <memory>
 
 #include <opencv2/opencv.hpp>
 
@@ -195,6 +196,34 @@ namespace motioncam {
         std::vector<uint8_t> data;
     };
 
+    struct ImageStatistics {
+        ImageStatistics() :
+            timestampNs(-1),
+            downscale(0),
+            clipped{0, 0, 0, 0},
+            keyValue(0)
+        {
+        }
+
+        // Frame and downscale the statistics were measured with
+        int64_t timestampNs;
+        int downscale;
+
+        // Histograms with 256 bins, normalised by the number of pixels
+        cv::Mat luminance;
+        cv::Mat channels[3];
+
+        // Fraction of clipped pixels in each raw channel
+        float clipped[4];
+
+        // Log average luminance
+        float keyValue;
+
+        // 8-bit luminance the histogram was built from and its pyramid, level 0 is the luminance itself
+        cv::Mat luma;
+        std::vector<cv::Mat> lumaPyramid;
+    };
+
     struct RawImageBuffer {
         
         RawImageBuffer(std::unique_ptr<NativeBuffer> buffer) :
@@ -223,7 +252,8 @@ namespace motioncam {
             width(other.width),
             height(other.height),
             rowStride(other.rowStride),
-            isCompressed(other.isCompressed)
+            isCompressed(other.isCompressed),
+            statistics(std::atomic_load(&other.statistics))
         {
             data = other.data->clone();
         }
@@ -235,7 +265,8 @@ namespace motioncam {
                 width(other.width),
                 height(other.height),
                 rowStride(other.rowStride),
-                isCompressed(other.isCompressed)
+                isCompressed(other.isCompressed),
+                statistics(std::move(other.statistics))
         {
         }
 
@@ -248,6 +279,8 @@ namespace motioncam {
             rowStride = obj.rowStride;
             isCompressed = obj.isCompressed;
 
+            std::atomic_store(&statistics, std::atomic_load(&obj.statistics));
+
             return *this;
         }
 
@@ -258,6 +291,9 @@ namespace motioncam {
         int32_t height;
         int32_t rowStride;
         bool isCompressed;
+
+        // Cached by ImageProcessor::measureStatistics(), only valid for the frame it was measured on
+        mutable std::shared_ptr<ImageStatistics> statistics;
     };
 
     struct RawCameraMetadata {
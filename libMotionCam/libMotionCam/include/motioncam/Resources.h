@@ -0,0 +1,19 @@
+#ifndef Resources_hpp
+#define Resources_hpp
+
+#include <opencv2/opencv.hpp>
+
+namespace motioncam {
+    namespace resources {
+        // Decoded RGBA blue noise texture used for dithering. Shared between callers, do not modify.
+        const cv::Mat& BlueNoise();
+        
+        // LBP frontal face classifier for the calling thread. Detection isn't thread safe so each thread gets its own.
+        cv::CascadeClassifier& FaceClassifier();
+        
+        // Loads the shared resources ahead of first use
+        void Prewarm();
+    }
+}
+
+#endif /* Resources_hpp */
@@ -0,0 +1,41 @@
+#ifndef SettingsEstimator_hpp
+#define SettingsEstimator_hpp
+
+#include <opencv2/opencv.hpp>
+
+#include <mutex>
+
+namespace motioncam {
+    struct RawImageBuffer;
+    struct RawCameraMetadata;
+    struct PostProcessSettings;
+
+    // Estimates settings for the live preview from a few rows of every frame. The luminance histogram of the sampled
+    // rows is blended into an exponentially smoothed histogram, so each frame costs the same and the estimate
+    // changes gradually. The sampled rows move down by one every frame so the whole image is covered over time.
+    // Frames can be added, estimated and reset from different threads.
+    class SettingsEstimator {
+    public:
+        SettingsEstimator(const int rowsPerFrame=32, const int columnStep=4, const float smoothing=0.2f);
+
+        void add(const RawImageBuffer& buffer, const RawCameraMetadata& cameraMetadata);
+
+        // Returns false until a frame has been added
+        bool estimate(PostProcessSettings& outSettings) const;
+        void reset();
+
+    private:
+        mutable std::mutex mLock;
+        int mRowsPerFrame;
+        int mColumnStep;
+        float mSmoothing;
+        int mRowOffset;
+
+        cv::Mat mHistogram;
+        float mKeyValue;
+        float mTemperature;
+        float mTint;
+    };
+}
+
+#endif /* SettingsEstimator_hpp */
@@ -3,11 +3,16 @@
 
 #include <string>
 #include <vector>
+#include <memory>
 
 #include <miniz_zip.h>
 #include <json11/json11.hpp>
 #include <opencv2/opencv.hpp>
 
+class dng_host;
+class dng_negative;
+class dng_memory_stream;
+
 namespace motioncam {
     struct RawImageMetadata;
     struct RawCameraMetadata;
@@ -23,6 +28,7 @@ namespace motioncam {
             void addFile(const std::string& filename, const std::string& data);
             void addFile(const std::string& filename, const void* data, const size_t numBytes);
             void addFile(const std::string& filename, const std::vector<uint8_t>& data, const size_t numBytes);
+            void addFile(const std::string& filename, mz_file_read_func readFunc, void* opaque, const size_t numBytes);
             
             void commit();
             
@@ -47,6 +53,135 @@ namespace motioncam {
             std::vector<std::string> mFiles;
         };
 
+        //
+        // Baseline JPEG written a strip at a time. Strips are encoded on their own and joined with restart
+        // markers so the whole image never has to be in memory.
+        //
+
+        class JpegStripWriter {
+        public:
+            JpegStripWriter(const std::string& outputPath, const int width, const int height, const int quality);
+            ~JpegStripWriter();
+            
+            // EXIF data in TIFF format, written as an APP1 segment. Must be set before any rows are written.
+            void setExif(const std::vector<uint8_t>& exifData);
+            
+            // Appends 8-bit BGR rows to the image. Rows are buffered until a full strip is available and
+            // complete strips are encoded in parallel.
+            void write(const cv::Mat& rows);
+            void commit();
+            
+        private:
+            void encodeStrips(const std::vector<cv::Mat>& strips);
+            void appendStrip(const std::vector<uint8_t>& encodedStrip);
+            
+        private:
+            FILE* mFile;
+            std::vector<uint8_t> mExifData;
+            const int mWidth;
+            const int mHeight;
+            const int mQuality;
+            int mStripHeight;
+            cv::Mat mPending;
+            int mPendingRows;
+            int mRowsEncoded;
+            int mStripsWritten;
+            bool mCommited;
+        };
+
+        //
+        // 16-bit RGB TIFF with compressed strips. Strips are compressed in parallel and the directory is
+        // written last so the whole image never has to be in memory.
+        //
+    
+        enum class TiffCompression : int {
+            DEFLATE = 8,
+            ZSTD = 50000     // Not supported by all readers
+        };
+    
+        class TiffStripWriter {
+        public:
+            TiffStripWriter(const std::string& outputPath,
+                            const int width,
+                            const int height,
+                            const TiffCompression compression=TiffCompression::DEFLATE);
+            ~TiffStripWriter();
+            
+            // Appends 16-bit BGR rows to the image
+            void write(const cv::Mat& rows);
+            void commit();
+            
+        private:
+            void encodeStrips(const std::vector<cv::Mat>& strips);
+            
+        private:
+            FILE* mFile;
+            const int mWidth;
+            const int mHeight;
+            const TiffCompression mCompression;
+            cv::Mat mPending;
+            int mPendingRows;
+            int mRowsEncoded;
+            uint64_t mOffset;
+            std::vector<uint32_t> mStripOffsets;
+            std::vector<uint32_t> mStripByteCounts;
+            bool mCommited;
+        };
+    
+        //
+        // Camera profile and lens shading opcodes that can be reused between the frames of a recording
+        //
+
+        class DngProfileCache {
+        public:
+            DngProfileCache(const RawCameraMetadata& cameraMetadata);
+            ~DngProfileCache();
+
+            void apply(dng_host& host, dng_negative& negative, const RawImageMetadata& imageMetadata, int width, int height);
+
+            // Frames are a crop of the full sensor area, the lens shading map is remapped to match
+            void setCropArea(const cv::Rect& cropArea, const cv::Size& fullSize);
+
+        private:
+            bool shadingMapChanged(const RawImageMetadata& imageMetadata) const;
+            void updateOpcodes(dng_host& host, const RawImageMetadata& imageMetadata, int width, int height);
+
+        private:
+            struct Profile;
+
+            std::unique_ptr<Profile> mProfile;
+            std::vector<cv::Mat> mShadingMap;
+            std::vector<uint8_t> mOpcodeList2;
+            cv::Size mOpcodeListSize;
+            cv::Rect mCropArea;
+            cv::Size mFullSize;
+        };
+
+        //
+        // DNG encoded into memory. It is written out straight from the stream it was encoded into, so
+        // encoding and writing can be timed on their own without another copy of the file.
+        //
+
+        class EncodedDng {
+        public:
+            EncodedDng(cv::Mat& rawImage,
+                       const RawCameraMetadata& cameraMetadata,
+                       const RawImageMetadata& imageMetadata,
+                       DngProfileCache& profileCache);
+            ~EncodedDng();
+
+            size_t size() const;
+
+            void write(ZipWriter& zipWriter, const std::string& outputName);
+            void write(const std::string& outputPath);
+
+        private:
+            static size_t read(void* opaque, mz_uint64 offset, void* buffer, size_t n);
+
+        private:
+            std::unique_ptr<dng_memory_stream> mStream;
+        };
+
 #ifdef ZSTD_AVAILABLE
         void ReadCompressedFile(const std::string& inputPath, std::vector<uint8_t>& output);
         void WriteCompressedFile(const std::vector<uint8_t>& data, const std::string& outputPath);
@@ -70,6 +205,20 @@ namespace motioncam {
                       ZipWriter& zipWriter,
                       const std::string& outputName);
 
+        void WriteDng(cv::Mat& rawImage,
+                      const RawCameraMetadata& cameraMetadata,
+                      const RawImageMetadata& imageMetadata,
+                      DngProfileCache& profileCache,
+                      const std::string& outputPath);
+
+        void WriteDng(cv::Mat& rawImage,
+                      const RawCameraMetadata& cameraMetadata,
+                      const RawImageMetadata& imageMetadata,
+                      DngProfileCache& profileCache,
+                      ZipWriter& zipWriter,
+                      const std::string& outputName);
+
+
     }
 }
 
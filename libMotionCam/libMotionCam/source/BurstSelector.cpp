@@ -0,0 +1,178 @@
+#include "motioncam/BurstSelector.h"
+#include "motioncam/RawImageMetadata.h"
+#include "motioncam/RawContainer.h"
+#include "motioncam/ImageProcessor.h"
+#include "motioncam/Logger.h"
+#include "motioncam/Measure.h"
+
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <set>
+
+namespace motioncam {
+    // Relative noise of the merged image at the scene key value
+    static const float TARGET_NOISE         = 0.02f;
+    static const int MIN_FRAMES             = 2;
+    static const float MIN_SCORE            = 0.25f;
+    static const float MAX_EV_DIFFERENCE    = 1.0f;
+    static const float MOTION_THRESHOLD     = 8.0f;
+    static const float MAX_MOTION_FRACTION  = 0.1f;
+
+    static double sharpness(const cv::Mat& luma) {
+        cv::Mat laplacian;
+        cv::Scalar mean, stddev;
+
+        cv::Laplacian(luma, laplacian, CV_32F);
+        cv::meanStdDev(laplacian, mean, stddev);
+
+        return stddev[0] * stddev[0];
+    }
+
+    // Fraction of the image that still differs from the reference after removing the global shift
+    static float motion(const cv::Mat& reference, const cv::Mat& luma) {
+        cv::Mat referenceF, lumaF, aligned, diff;
+
+        reference.convertTo(referenceF, CV_32F);
+        luma.convertTo(lumaF, CV_32F);
+
+        cv::Point2d shift = cv::phaseCorrelate(referenceF, lumaF);
+        cv::Mat translation = (cv::Mat_<double>(2, 3) << 1, 0, -shift.x, 0, 1, -shift.y);
+
+        cv::warpAffine(lumaF, aligned, translation, lumaF.size(), cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+        cv::absdiff(referenceF, aligned, diff);
+
+        return cv::countNonZero(diff > MOTION_THRESHOLD) / static_cast<float>(diff.total());
+    }
+
+    std::vector<std::shared_ptr<RawImageBuffer>> BurstSelector::select(
+        const RawCameraMetadata& cameraMetadata,
+        const std::shared_ptr<RawImageBuffer>& reference,
+        const std::vector<std::shared_ptr<RawImageBuffer>>& candidates)
+    {
+        Measure measure("BurstSelector::select()");
+
+        std::vector<std::shared_ptr<RawImageBuffer>> result = { reference };
+
+        // Without a noise model there is nothing to aim for, keep every frame
+        const auto& noiseProfile = reference->metadata.noiseProfile;
+
+        if(noiseProfile.size() < 2) {
+            result.insert(result.end(), candidates.begin(), candidates.end());
+            return result;
+        }
+
+        auto refStatistics = ImageProcessor::measureStatistics(cameraMetadata, *reference);
+        if(refStatistics->lumaPyramid.size() < 2) {
+            result.insert(result.end(), candidates.begin(), candidates.end());
+            return result;
+        }
+
+        const double refEv = ImageProcessor::calcEv(cameraMetadata, reference->metadata);
+        const double refSharpness = sharpness(refStatistics->lumaPyramid[0]);
+
+        // Score the candidates in parallel
+        std::vector<float> scores(candidates.size(), 0.0f);
+
+        cv::parallel_for_(cv::Range(0, static_cast<int>(candidates.size())), [&](const cv::Range& range) {
+            for(int i = range.start; i < range.end; i++) {
+                const auto& candidate = candidates[i];
+
+                float ev = static_cast<float>(std::abs(ImageProcessor::calcEv(cameraMetadata, candidate->metadata) - refEv));
+                float exposureScore = std::max(0.0f, 1.0f - ev / MAX_EV_DIFFERENCE);
+
+                if(exposureScore <= 0)
+                    continue;
+
+                auto statistics = ImageProcessor::measureStatistics(cameraMetadata, *candidate);
+                if(statistics->lumaPyramid.size() < 2)
+                    continue;
+
+                float sharpnessScore =
+                    static_cast<float>(std::min(1.0, sharpness(statistics->lumaPyramid[0]) / std::max(1e-5, refSharpness)));
+
+                float motionScore =
+                    std::max(0.0f, 1.0f - motion(refStatistics->lumaPyramid[1], statistics->lumaPyramid[1]) / MAX_MOTION_FRACTION);
+
+                scores[i] = exposureScore * sharpnessScore * motionScore;
+            }
+        });
+
+        // Number of reference quality frames needed to reach the target noise
+        const float x = std::max(1e-3f, refStatistics->keyValue);
+        const float noise = static_cast<float>(std::sqrt(noiseProfile[0]*x + noiseProfile[1]) / x);
+        const float requiredFrames = std::max(static_cast<float>(MIN_FRAMES), (noise / TARGET_NOISE) * (noise / TARGET_NOISE));
+
+        // Best candidates first, keeping the given order when the scores are equal
+        std::vector<int> order(candidates.size());
+
+        for(int i = 0; i < order.size(); i++)
+            order[i] = i;
+
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return scores[a] > scores[b]; });
+
+        float totalFrames = 1.0f;
+
+        for(int i : order) {
+            if(totalFrames >= requiredFrames || scores[i] < MIN_SCORE)
+                break;
+
+            result.push_back(candidates[i]);
+            totalFrames += scores[i];
+        }
+
+        logger::log("Selected " + std::to_string(result.size()) + " of " + std::to_string(candidates.size() + 1) +
+                    " frames (noise " + std::to_string(noise) + ")");
+
+        return result;
+    }
+
+    void BurstSelector::filter(RawContainer& rawContainer) {
+        Measure measure("BurstSelector::filter()");
+
+        const auto& cameraMetadata = rawContainer.getCameraMetadata();
+        const std::string referenceName = rawContainer.getReferenceImage();
+
+        auto reference = rawContainer.loadFrame(referenceName);
+
+        // Closest to the reference first
+        std::vector<std::string> candidateNames;
+
+        for(auto& frameName : rawContainer.getFrames()) {
+            if(frameName != referenceName)
+                candidateNames.push_back(frameName);
+        }
+
+        std::stable_sort(candidateNames.begin(), candidateNames.end(), [&](const std::string& a, const std::string& b) {
+            auto da = std::abs(rawContainer.getFrame(a)->metadata.timestampNs - reference->metadata.timestampNs);
+            auto db = std::abs(rawContainer.getFrame(b)->metadata.timestampNs - reference->metadata.timestampNs);
+
+            return da < db;
+        });
+
+        // Measure the statistics one frame at a time since the container can't be read in parallel.
+        // They are cached in the buffers so the frame data is not needed for scoring.
+        ImageProcessor::measureStatistics(cameraMetadata, *reference);
+
+        std::vector<std::shared_ptr<RawImageBuffer>> candidates;
+
+        for(auto& frameName : candidateNames) {
+            bool isLoaded = rawContainer.getFrame(frameName)->data->len() > 0;
+            auto frame = rawContainer.loadFrame(frameName);
+
+            ImageProcessor::measureStatistics(cameraMetadata, *frame);
+
+            if(!isLoaded)
+                frame->data->release();
+
+            candidates.push_back(frame);
+        }
+
+        auto selected = select(cameraMetadata, reference, candidates);
+        std::set<std::shared_ptr<RawImageBuffer>> keep(selected.begin(), selected.end());
+
+        for(int i = 0; i < candidates.size(); i++) {
+            if(keep.find(candidates[i]) == keep.end())
+                rawContainer.removeFrame(candidateNames[i]);
+        }
+    }
+}
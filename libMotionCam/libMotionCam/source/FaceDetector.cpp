@@ -0,0 +1,213 @@
+#include "motioncam/FaceDetector.h"
+#include "motioncam/RawImageMetadata.h"
+#include "motioncam/ImageProcessor.h"
+#include "motioncam/Resources.h"
+#include "motioncam/Measure.h"
+
+namespace motioncam {
+    static const double SEARCH_SCALE_FACTOR = 1.5;
+    static const double TRACK_SCALE_FACTOR  = 1.1;
+    static const int MIN_NEIGHBOURS         = 3;
+    static const float TRACK_MARGIN         = 0.5f;
+    static const float MAX_OVERLAP          = 0.3f;
+
+    // Statistics are measured at a quarter of the sensor resolution, the same resolution faces were searched at
+    // on the fast preview
+    static const int STATISTICS_DOWNSCALE   = 2;
+
+    // Same orientation as fast_preview so the coordinates don't change for callers
+    static cv::Mat orient(const cv::Mat& input, const ScreenOrientation orientation) {
+        cv::Mat output;
+
+        switch(orientation) {
+            case ScreenOrientation::PORTRAIT:
+                cv::rotate(input, output, cv::ROTATE_90_CLOCKWISE);
+                break;
+
+            case ScreenOrientation::REVERSE_PORTRAIT:
+                cv::rotate(input, output, cv::ROTATE_90_COUNTERCLOCKWISE);
+                break;
+
+            case ScreenOrientation::REVERSE_LANDSCAPE:
+                cv::flip(input, output, 0);
+                break;
+
+            default:
+            case ScreenOrientation::LANDSCAPE:
+                output = input;
+                break;
+        }
+
+        return output;
+    }
+
+    // Equalisation table from the luminance histogram measured with the statistics, same as cv::equalizeHist()
+    static cv::Mat equalisation(const cv::Mat& histogram) {
+        cv::Mat lut(1, 256, CV_8U);
+
+        float cdf = 0.0f;
+        float cdfMin = -1.0f;
+
+        for(int i = 0; i < histogram.cols; i++) {
+            cdf += histogram.at<float>(i);
+
+            if(cdfMin < 0 && cdf > 0)
+                cdfMin = cdf;
+
+            float v = (cdf - cdfMin) / std::max(1e-5f, 1.0f - cdfMin);
+
+            lut.at<uint8_t>(i) = cv::saturate_cast<uint8_t>(v * 255.0f + 0.5f);
+        }
+
+        return lut;
+    }
+
+    static std::vector<cv::Rect2f> normalise(const std::vector<cv::Rect>& dets, const cv::Point& offset, const cv::Size& size) {
+        std::vector<cv::Rect2f> result;
+
+        for(auto& d : dets) {
+            result.push_back(cv::Rect2f(
+                (d.x + offset.x) / (float) size.width,
+                (d.y + offset.y) / (float) size.height,
+                d.width / (float) size.width,
+                d.height / (float) size.height));
+        }
+
+        return result;
+    }
+
+    // Faces tracked on neighbouring levels can overlap, keep the larger one
+    static std::vector<cv::Rect2f> merge(std::vector<cv::Rect2f> faces) {
+        std::sort(faces.begin(), faces.end(), [](const cv::Rect2f& a, const cv::Rect2f& b) { return a.area() > b.area(); });
+
+        std::vector<cv::Rect2f> result;
+
+        for(auto& face : faces) {
+            bool overlaps = false;
+
+            for(auto& r : result) {
+                float intersection = (face & r).area();
+
+                if(intersection / (face.area() + r.area() - intersection) > MAX_OVERLAP) {
+                    overlaps = true;
+                    break;
+                }
+            }
+
+            if(!overlaps)
+                result.push_back(face);
+        }
+
+        return result;
+    }
+
+    FaceDetector::FaceDetector(const int fullSearchInterval) :
+        mFullSearchInterval(std::max(1, fullSearchInterval)),
+        mFramesSinceFullSearch(0)
+    {
+    }
+
+    void FaceDetector::reset() {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        mFramesSinceFullSearch = 0;
+        mFaces.clear();
+    }
+
+    std::vector<cv::Rect2f> FaceDetector::detect(const RawImageBuffer& buffer, const RawCameraMetadata& cameraMetadata) {
+        Measure measure("FaceDetector::detect()");
+
+        auto statistics = ImageProcessor::measureStatistics(cameraMetadata, buffer, STATISTICS_DOWNSCALE);
+        if(statistics->lumaPyramid.empty())
+            return std::vector<cv::Rect2f>();
+
+        // Equalise and orient each level
+        cv::Mat lut = equalisation(statistics->luminance);
+        std::vector<cv::Mat> pyramid;
+
+        for(auto& level : statistics->lumaPyramid) {
+            cv::Mat equalised;
+            cv::LUT(level, lut, equalised);
+
+            pyramid.push_back(orient(equalised, buffer.metadata.screenOrientation));
+        }
+
+        std::lock_guard<std::mutex> lock(mLock);
+
+        std::vector<cv::Rect2f> faces;
+
+        if(!mFaces.empty() && mFramesSinceFullSearch < mFullSearchInterval) {
+            faces = track(pyramid);
+            ++mFramesSinceFullSearch;
+        }
+
+        // Search everywhere periodically or when the tracked faces are lost
+        if(faces.empty()) {
+            faces = search(pyramid);
+            mFramesSinceFullSearch = 0;
+        }
+
+        mFaces = faces;
+
+        return faces;
+    }
+
+    std::vector<cv::Rect2f> FaceDetector::search(const std::vector<cv::Mat>& pyramid) const {
+        // A single pass over the finest level, detectMultiScale() runs the scales in parallel
+        cv::CascadeClassifier& c = resources::FaceClassifier();
+        std::vector<cv::Rect> dets;
+
+        c.detectMultiScale(pyramid[0], dets, SEARCH_SCALE_FACTOR, MIN_NEIGHBOURS, 0, c.getOriginalWindowSize());
+
+        return normalise(dets, cv::Point(0, 0), pyramid[0].size());
+    }
+
+    std::vector<cv::Rect2f> FaceDetector::track(const std::vector<cv::Mat>& pyramid) const {
+        std::vector<std::vector<cv::Rect2f>> trackedFaces(mFaces.size());
+
+        cv::parallel_for_(cv::Range(0, static_cast<int>(mFaces.size())), [&](const cv::Range& range) {
+            cv::CascadeClassifier& c = resources::FaceClassifier();
+            cv::Size window = c.getOriginalWindowSize();
+
+            for(int i = range.start; i < range.end; i++) {
+                const cv::Rect2f& face = mFaces[i];
+
+                // Coarsest level where the face is still larger than the classifier window
+                int level = 0;
+
+                while(level + 1 < static_cast<int>(pyramid.size()) && face.width * pyramid[level + 1].cols >= window.width)
+                    ++level;
+
+                const cv::Mat& image = pyramid[level];
+
+                cv::Rect2f roi(
+                    face.x - face.width * TRACK_MARGIN,
+                    face.y - face.height * TRACK_MARGIN,
+                    face.width * (1 + 2*TRACK_MARGIN),
+                    face.height * (1 + 2*TRACK_MARGIN));
+
+                cv::Rect roiPx(
+                    cv::Point(cvFloor(roi.x * image.cols), cvFloor(roi.y * image.rows)),
+                    cv::Point(cvCeil(roi.br().x * image.cols), cvCeil(roi.br().y * image.rows)));
+
+                roiPx &= cv::Rect(0, 0, image.cols, image.rows);
+
+                if(roiPx.width < window.width || roiPx.height < window.height)
+                    continue;
+
+                std::vector<cv::Rect> dets;
+
+                c.detectMultiScale(image(roiPx), dets, TRACK_SCALE_FACTOR, MIN_NEIGHBOURS, 0, window);
+
+                trackedFaces[i] = normalise(dets, roiPx.tl(), image.size());
+            }
+        });
+
+        std::vector<cv::Rect2f> faces;
+
+        for(auto& f : trackedFaces)
+            faces.insert(faces.end(), f.begin(), f.end());
+
+        return merge(faces);
+    }
+}
@@ -8,8 +8,9 @@
 #include "motioncam/Measure.h"
 #include "motioncam/Settings.h"
 #include "motioncam/ImageOps.h"
-#include "motioncam/BlueNoiseLUT.h"
-#include "motioncam/FaceClassifier.h"
+#include "motioncam/Resources.h"
+#include "motioncam/FaceDetector.h"
+#include "motioncam/BurstSelector.h"
 
 // Halide
 #include "generate_edges.h"
@@ -25,8 +26,15 @@
 #include "measure_noise.h"
 
 #include "linear_image.h"
-#include "hdr_mask.h"
-
+#include "hdr_ghost_mask1.h"
+#include "hdr_ghost_mask2.h"
+#include "hdr_ghost_mask3.h"
+#include "hdr_ghost_mask4.h"
+
+#include "preview_landscape1.h"
+#include "preview_portrait1.h"
+#include "preview_reverse_portrait1.h"
+#include "preview_reverse_landscape1.h"
 #include "preview_landscape2.h"
 #include "preview_portrait2.h"
 #include "preview_reverse_portrait2.h"
@@ -39,9 +47,31 @@
 #include "preview_portrait8.h"
 #include "preview_reverse_portrait8.h"
 #include "preview_reverse_landscape8.h"
+#include "fused_preview_landscape1.h"
+#include "fused_preview_portrait1.h"
+#include "fused_preview_reverse_portrait1.h"
+#include "fused_preview_reverse_landscape1.h"
+#include "fused_preview_landscape2.h"
+#include "fused_preview_portrait2.h"
+#include "fused_preview_reverse_portrait2.h"
+#include "fused_preview_reverse_landscape2.h"
+#include "fused_preview_landscape4.h"
+#include "fused_preview_portrait4.h"
+#include "fused_preview_reverse_portrait4.h"
+#include "fused_preview_reverse_landscape4.h"
+#include "fused_preview_landscape8.h"
+#include "fused_preview_portrait8.h"
+#include "fused_preview_reverse_portrait8.h"
+#include "fused_preview_reverse_landscape8.h"
 
 #include "postprocess.h"
+#include "postprocess_nohdr.h"
+#include "postprocess16.h"
+#include "postprocess16_nohdr.h"
 #include "deghost.h"
+#include "deghost1.h"
+#include "deghost2.h"
+#include "deghost3.h"
 
 #include <iostream>
 #include <fstream>
@@ -93,9 +123,18 @@ static std::vector<Halide::Runtime::Buffer<float>> createWaveletBuffers(int widt
 namespace motioncam {
     const int EXPANDED_RANGE            = 16384;
     const float MAX_HDR_ERROR           = 0.005f;
+    const int MAX_HDR_BRACKETS          = 4;
+    
+    // The HDR ghost error is measured on previews downscaled by this much. The error is a fraction of the image
+    // area and the ghost mask erosion is scaled to match (see generate.sh), so MAX_HDR_ERROR is unchanged.
+    const int HDR_PREVIEW_DOWNSCALE     = 2;
+    
+    const int LUMA_PYRAMID_LEVELS       = 3;
+    const int ALIGN_PYRAMID_LEVELS      = 5;
+    const int ECC_GAUSSIAN_SIZE         = 5;
     const float WHITEPOINT_THRESHOLD    = 1.0f;
     const float SHADOW_BIAS             = 20.0f;
-
+    
     typedef Halide::Runtime::Buffer<float> WaveletBuffer;
 
     struct RawData {
@@ -179,6 +218,43 @@ namespace motioncam {
         return std::string(result);
     }
 
+    // Undoes the rotation and mirroring of the preview so the thumbnail matches the stored image
+    static cv::Mat CreateThumbnail(const cv::Mat& preview, const ScreenOrientation orientation, const bool flipped) {
+        cv::Mat thumbnail;
+        
+        switch(orientation) {
+            case ScreenOrientation::REVERSE_PORTRAIT:
+                cv::transpose(preview, thumbnail);
+                cv::flip(thumbnail, thumbnail, flipped ? -1 : 1);
+                break;
+                
+            case ScreenOrientation::PORTRAIT:
+                cv::transpose(preview, thumbnail);
+                if(!flipped)
+                    cv::flip(thumbnail, thumbnail, 0);
+                break;
+                
+            case ScreenOrientation::REVERSE_LANDSCAPE:
+                cv::flip(preview, thumbnail, 0);
+                break;
+                
+            default:
+            case ScreenOrientation::LANDSCAPE:
+                if(flipped)
+                    cv::flip(preview, thumbnail, 1);
+                else
+                    thumbnail = preview;
+                break;
+        }
+        
+        int width = 320;
+        int height = (int) std::lround((thumbnail.rows / (double) thumbnail.cols) * width);
+        
+        cv::resize(thumbnail, thumbnail, cv::Size(width, height), 0, 0, cv::INTER_AREA);
+        
+        return thumbnail;
+    }
+
     template<typename T>
     static Halide::Runtime::Buffer<T> ToHalideBuffer(const cv::Mat& input) {
         if(input.channels() > 1)
@@ -242,6 +318,133 @@ namespace motioncam {
     }
 
 
+    static void PostProcessRegion(Halide::Runtime::Buffer<uint16_t>* inputBuffers,
+                                  Halide::Runtime::Buffer<float>* shadingMapBuffers,
+                                  Halide::Runtime::Buffer<uint16_t>& hdrInput,
+                                  const bool useHdr,
+                                  const float hdrInputGain,
+                                  const float hdrScale,
+                                  const float tonemapVariance,
+                                  Halide::Runtime::Buffer<uint8_t>& noiseBuffer,
+                                  Halide::Runtime::Buffer<float>& cameraToSrgbBuffer,
+                                  const float noiseEstimate,
+                                  const RawImageMetadata& metadata,
+                                  const RawCameraMetadata& cameraMetadata,
+                                  const PostProcessSettings& settings,
+                                  Halide::Runtime::Buffer<>& outputBuffer)
+    {
+        for(int i = 0; i < 4; i++) {
+            inputBuffers[i].set_host_dirty();
+            shadingMapBuffers[i].set_host_dirty();
+        }
+
+        // The HDR input is never read by the variant without HDR
+        auto method = useHdr ? &postprocess : &postprocess_nohdr;
+        
+        if(outputBuffer.type() == halide_type_of<uint16_t>())
+            method = useHdr ? &postprocess16 : &postprocess16_nohdr;
+        
+        method(inputBuffers[0],
+               inputBuffers[1],
+               inputBuffers[2],
+               inputBuffers[3],
+               noiseBuffer,
+               hdrInput,
+               useHdr,
+               metadata.asShot[0],
+               metadata.asShot[1],
+               metadata.asShot[2],
+               cameraToSrgbBuffer,
+               shadingMapBuffers[0],
+               shadingMapBuffers[1],
+               shadingMapBuffers[2],
+               shadingMapBuffers[3],
+               EXPANDED_RANGE,
+               static_cast<int>(cameraMetadata.sensorArrangment),
+               settings.shadows,
+               hdrInputGain,
+               hdrScale,
+               tonemapVariance,
+               settings.blacks,
+               settings.exposure,
+               settings.whitePoint,
+               settings.contrast,
+               settings.blues,
+               settings.greens,
+               settings.saturation,
+               settings.sharpen0,
+               settings.sharpen1,
+               settings.pop,
+               128.0f,
+               7.0f,
+               std::min(0.015f, std::max(0.005f, noiseEstimate / 2.0f)),
+               outputBuffer);
+
+        outputBuffer.device_sync();
+        outputBuffer.copy_to_host();
+    }
+
+    static bool IsTiffPath(const std::string& path) {
+        std::string extension = path.substr(path.find_last_of('.') + 1);
+        
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        
+        return extension == "tif" || extension == "tiff";
+    }
+
+    // Wraps an interleaved 8 or 16-bit RGB image as the output of the postprocess pipeline
+    static Halide::Runtime::Buffer<> ToOutputBuffer(cv::Mat& output) {
+        const halide_type_t type = output.depth() == CV_16U ? halide_type_of<uint16_t>() : halide_type_of<uint8_t>();
+        
+        return Halide::Runtime::Buffer<>::make_interleaved(type, output.data, output.cols, output.rows, 3);
+    }
+
+    static void GetHdrParameters(const shared_ptr<HdrMetadata>& hdrMetadata,
+                                 bool& outUseHdr,
+                                 float& outHdrInputGain,
+                                 float& outHdrScale,
+                                 float& outTonemapVariance)
+    {
+        outTonemapVariance = 0.27f;
+        outUseHdr = false;
+        outHdrInputGain = 1.0f;
+        outHdrScale = 1.0f;
+        
+        if(hdrMetadata && hdrMetadata->error < MAX_HDR_ERROR) {
+            outHdrInputGain = hdrMetadata->gain;
+            outHdrScale = 1.0f / hdrMetadata->exposureScale;
+            outUseHdr = true;
+            outTonemapVariance = 0.22f;
+        }
+        else if(hdrMetadata) {
+            // Don't apply underexposed image when error is too high
+            logger::log("Not using HDR image, error too high (" + std::to_string(hdrMetadata->error) + ")");
+        }
+    }
+
+    static Halide::Runtime::Buffer<float> CreateCameraToSrgbBuffer(const RawImageMetadata& metadata,
+                                                                   const RawCameraMetadata& cameraMetadata,
+                                                                   const PostProcessSettings& settings,
+                                                                   cv::Mat& outCameraToSrgb)
+    {
+        cv::Mat cameraToPcs;
+        cv::Mat pcsToSrgb;
+        cv::Vec3f cameraWhite;
+
+        if(settings.temperature > 0 || settings.tint > 0) {
+            Temperature t(settings.temperature, settings.tint);
+
+            ImageProcessor::createSrgbMatrix(cameraMetadata, metadata, t, cameraWhite, cameraToPcs, pcsToSrgb);
+        }
+        else {
+            ImageProcessor::createSrgbMatrix(cameraMetadata, metadata, metadata.asShot, cameraWhite, cameraToPcs, pcsToSrgb);
+        }
+
+        outCameraToSrgb = pcsToSrgb * cameraToPcs;
+        
+        return ToHalideBuffer<float>(outCameraToSrgb);
+    }
+
     cv::Mat ImageProcessor::postProcess(std::vector<Halide::Runtime::Buffer<uint16_t>>& inputBuffers,
                                         const shared_ptr<HdrMetadata>& hdrMetadata,
                                         int offsetX,
@@ -249,117 +452,62 @@ namespace motioncam {
                                         const float noiseEstimate,
                                         const RawImageMetadata& metadata,
                                         const RawCameraMetadata& cameraMetadata,
-                                        const PostProcessSettings& settings)
+                                        const PostProcessSettings& settings,
+                                        const int outputType)
     {
         Measure measure("postProcess");
+        
+        if(outputType != CV_8UC3 && outputType != CV_16UC3)
+            throw InvalidState("Invalid output type");
 
         Halide::Runtime::Buffer<float> shadingMapBuffer[4];
         for(int i = 0; i < 4; i++) {
             shadingMapBuffer[i] = ToHalideBuffer<float>(metadata.lensShadingMap[i]);
         }
 
-        cv::Mat cameraToPcs;
-        cv::Mat pcsToSrgb;
-        cv::Vec3f cameraWhite;
-
-        if(settings.temperature > 0 || settings.tint > 0) {
-            Temperature t(settings.temperature, settings.tint);
-
-            createSrgbMatrix(cameraMetadata, metadata, t, cameraWhite, cameraToPcs, pcsToSrgb);
-        }
-        else {
-            createSrgbMatrix(cameraMetadata, metadata, metadata.asShot, cameraWhite, cameraToPcs, pcsToSrgb);
-        }
+        cv::Mat cameraToSrgb;
+        Halide::Runtime::Buffer<float> cameraToSrgbBuffer = CreateCameraToSrgbBuffer(metadata, cameraMetadata, settings, cameraToSrgb);
 
         // Get blue noise buffer
-        auto noise = cv::imdecode(BLUE_NOISE_PNG, cv::IMREAD_UNCHANGED);
+        const cv::Mat& noise = resources::BlueNoise();
                 
         Halide::Runtime::Buffer<uint8_t> noiseBuffer =
             Halide::Runtime::Buffer<uint8_t>::make_interleaved((uint8_t*) noise.data, noise.cols, noise.rows, 4);
         
-        cv::Mat cameraToSrgb = pcsToSrgb * cameraToPcs;
-        
-        Halide::Runtime::Buffer<float> cameraToSrgbBuffer = ToHalideBuffer<float>(cameraToSrgb);
-        
-        cv::Mat output((inputBuffers[0].height() - offsetY)*2, (inputBuffers[0].width() - offsetX)*2, CV_8UC3);
+        cv::Mat output((inputBuffers[0].height() - offsetY)*2, (inputBuffers[0].width() - offsetX)*2, outputType);
         
-        Halide::Runtime::Buffer<uint8_t> outputBuffer(
-            Halide::Runtime::Buffer<uint8_t>::make_interleaved(output.data, output.cols, output.rows, 3));
+        Halide::Runtime::Buffer<> outputBuffer = ToOutputBuffer(output);
 
         // Edges are garbage, don't process them
         outputBuffer.translate(0, offsetX);
         outputBuffer.translate(1, offsetY);
 
-        for(int i = 0; i < 4; i++) {
-            inputBuffers[i].set_host_dirty();
-            shadingMapBuffer[i].set_host_dirty();
-        }
-        
         Halide::Runtime::Buffer<uint16_t> hdrInput;
         
-        float shadows = settings.shadows;
+        bool useHdr;
+        float hdrInputGain, hdrScale, tonemapVariance;
         
-        float tonemapVariance = 0.27f;
-        bool useHdr = false;
-        float hdrInputGain = 1.0f;
-        float hdrScale = 1.0f;
+        GetHdrParameters(hdrMetadata, useHdr, hdrInputGain, hdrScale, tonemapVariance);
         
-        if(hdrMetadata && hdrMetadata->error < MAX_HDR_ERROR) {
+        if(useHdr)
             hdrInput = hdrMetadata->hdrInput;
-            
-            hdrInputGain = hdrMetadata->gain;
-            hdrScale = 1.0f / hdrMetadata->exposureScale;
-            useHdr = true;
-            tonemapVariance = 0.22f;
-        }
-        else {
-            // Don't apply underexposed image when error is too high
-            if(hdrMetadata)
-                logger::log("Not using HDR image, error too high (" + std::to_string(hdrMetadata->error) + ")");
-            
-            hdrInput = Halide::Runtime::Buffer<uint16_t>(inputBuffers[0].width()*2, inputBuffers[0].height()*2, 3);
-            
-            useHdr = false;
-        }
-        
-        postprocess(inputBuffers[0],
-                    inputBuffers[1],
-                    inputBuffers[2],
-                    inputBuffers[3],
-                    noiseBuffer,
-                    hdrInput,
-                    useHdr,
-                    metadata.asShot[0],
-                    metadata.asShot[1],
-                    metadata.asShot[2],
-                    cameraToSrgbBuffer,
-                    shadingMapBuffer[0],
-                    shadingMapBuffer[1],
-                    shadingMapBuffer[2],
-                    shadingMapBuffer[3],
-                    EXPANDED_RANGE,
-                    static_cast<int>(cameraMetadata.sensorArrangment),
-                    shadows,
-                    hdrInputGain,
-                    hdrScale,
-                    tonemapVariance,
-                    settings.blacks,
-                    settings.exposure,
-                    settings.whitePoint,
-                    settings.contrast,
-                    settings.blues,
-                    settings.greens,
-                    settings.saturation,
-                    settings.sharpen0,
-                    settings.sharpen1,
-                    settings.pop,
-                    128.0f,
-                    7.0f,
-                    std::min(0.015f, std::max(0.005f, noiseEstimate / 2.0f)),
-                    outputBuffer);
-
-        outputBuffer.device_sync();
-        outputBuffer.copy_to_host();
+        else
+            hdrInput = Halide::Runtime::Buffer<uint16_t>(1, 1, 3);
+        
+        PostProcessRegion(inputBuffers.data(),
+                          shadingMapBuffer,
+                          hdrInput,
+                          useHdr,
+                          hdrInputGain,
+                          hdrScale,
+                          tonemapVariance,
+                          noiseBuffer,
+                          cameraToSrgbBuffer,
+                          noiseEstimate,
+                          metadata,
+                          cameraMetadata,
+                          settings,
+                          outputBuffer);
         
         return output;
     }
@@ -547,13 +695,13 @@ namespace motioncam {
 
         cameraProfile.temperatureFromVector(rawBuffer.metadata.asShot, temperature);
 
-        cv::Mat histogram = calcHistogram(cameraMetadata, rawBuffer, false, 4);
+        auto statistics = measureStatistics(cameraMetadata, rawBuffer);
 
         outSettings.temperature    = static_cast<float>(temperature.temperature());
         outSettings.tint           = static_cast<float>(temperature.tint());
-        outSettings.shadows        = estimateShadows(histogram, keyValue);
-        outSettings.exposure       = estimateExposureCompensation(histogram, 1e-3f);
-        outSettings.hdr            = estimateHdr(histogram);
+        outSettings.shadows        = estimateShadows(statistics->luminance, keyValue);
+        outSettings.exposure       = estimateExposureCompensation(statistics->luminance, 1e-3f);
+        outSettings.hdr            = estimateHdr(statistics->luminance);
     }
 
     void ImageProcessor::createSrgbMatrix(const RawCameraMetadata& cameraMetadata,
@@ -612,11 +760,12 @@ namespace motioncam {
     Halide::Runtime::Buffer<uint8_t> ImageProcessor::createPreview(const RawImageBuffer& rawBuffer,
                                                                    const int downscaleFactor,
                                                                    const RawCameraMetadata& cameraMetadata,
-                                                                   const PostProcessSettings& settings)
+                                                                   const PostProcessSettings& settings,
+                                                                   const bool fast)
     {
         //Measure measure("createPreview()");
         
-        if(downscaleFactor != 2 && downscaleFactor != 4 && downscaleFactor != 8) {
+        if(downscaleFactor != 1 && downscaleFactor != 2 && downscaleFactor != 4 && downscaleFactor != 8) {
             throw InvalidState("Invalid downscale factor");
         }
         
@@ -649,88 +798,162 @@ namespace motioncam {
         int height = rawBuffer.height / 2 / downscaleFactor;
         
         auto method = &preview_landscape2;
+        auto fastMethod = &fused_preview_landscape2;
         
         switch(rawBuffer.metadata.screenOrientation) {
             case ScreenOrientation::REVERSE_PORTRAIT:
-                if(downscaleFactor == 2)
+                if(downscaleFactor == 1) {
+                    method = &preview_reverse_portrait1;
+                    fastMethod = &fused_preview_reverse_portrait1;
+                }
+                else if(downscaleFactor == 2) {
                     method = &preview_reverse_portrait2;
-                else if(downscaleFactor == 4)
+                    fastMethod = &fused_preview_reverse_portrait2;
+                }
+                else if(downscaleFactor == 4) {
                     method = &preview_reverse_portrait4;
-                else
+                    fastMethod = &fused_preview_reverse_portrait4;
+                }
+                else {
                     method = &preview_reverse_portrait8;
+                    fastMethod = &fused_preview_reverse_portrait8;
+                }
 
                 std::swap(width, height);
                 break;
 
             case ScreenOrientation::REVERSE_LANDSCAPE:
-                if(downscaleFactor == 2)
+                if(downscaleFactor == 1) {
+                    method = &preview_reverse_landscape1;
+                    fastMethod = &fused_preview_reverse_landscape1;
+                }
+                else if(downscaleFactor == 2) {
                     method = &preview_reverse_landscape2;
-                else if(downscaleFactor == 4)
+                    fastMethod = &fused_preview_reverse_landscape2;
+                }
+                else if(downscaleFactor == 4) {
                     method = &preview_reverse_landscape4;
-                else
+                    fastMethod = &fused_preview_reverse_landscape4;
+                }
+                else {
                     method = &preview_reverse_landscape8;
+                    fastMethod = &fused_preview_reverse_landscape8;
+                }
 
                 break;
 
             case ScreenOrientation::PORTRAIT:
-                if(downscaleFactor == 2)
+                if(downscaleFactor == 1) {
+                    method = &preview_portrait1;
+                    fastMethod = &fused_preview_portrait1;
+                }
+                else if(downscaleFactor == 2) {
                     method = &preview_portrait2;
-                else if(downscaleFactor == 4)
+                    fastMethod = &fused_preview_portrait2;
+                }
+                else if(downscaleFactor == 4) {
                     method = &preview_portrait4;
-                else
+                    fastMethod = &fused_preview_portrait4;
+                }
+                else {
                     method = &preview_portrait8;
+                    fastMethod = &fused_preview_portrait8;
+                }
 
                 std::swap(width, height);
                 break;
 
             default:
             case ScreenOrientation::LANDSCAPE:
-                if(downscaleFactor == 2)
+                if(downscaleFactor == 1) {
+                    method = &preview_landscape1;
+                    fastMethod = &fused_preview_landscape1;
+                }
+                else if(downscaleFactor == 2) {
                     method = &preview_landscape2;
-                else if(downscaleFactor == 4)
+                    fastMethod = &fused_preview_landscape2;
+                }
+                else if(downscaleFactor == 4) {
                     method = &preview_landscape4;
-                else
+                    fastMethod = &fused_preview_landscape4;
+                }
+                else {
                     method = &preview_landscape8;
+                    fastMethod = &fused_preview_landscape8;
+                }
                 break;
         }
        
         Halide::Runtime::Buffer<uint8_t> outputBuffer =
             Halide::Runtime::Buffer<uint8_t>::make_interleaved(width, height, 4);
         
-        method(
-            inputBufferContext.getHalideBuffer(),
-            shadingMapBuffer[0],
-            shadingMapBuffer[1],
-            shadingMapBuffer[2],
-            shadingMapBuffer[3],
-            rawBuffer.metadata.asShot[0],
-            rawBuffer.metadata.asShot[1],
-            rawBuffer.metadata.asShot[2],
-            cameraToSrgbBuffer,
-            rawBuffer.width / 2 / downscaleFactor,
-            rawBuffer.height / 2 / downscaleFactor,
-            rawBuffer.rowStride,
-            static_cast<int>(rawBuffer.pixelFormat),
-            static_cast<int>(cameraMetadata.sensorArrangment),
-            cameraMetadata.blackLevel[0],
-            cameraMetadata.blackLevel[1],
-            cameraMetadata.blackLevel[2],
-            cameraMetadata.blackLevel[3],
-            static_cast<uint16_t>(cameraMetadata.whiteLevel),
-            settings.shadows,
-            settings.whitePoint,
-            0.25f,
-            settings.blacks,
-            settings.exposure,
-            settings.contrast,
-            settings.blues,
-            settings.greens,
-            settings.saturation,
-            settings.sharpen0,
-            settings.sharpen1,
-            settings.pop,
-            settings.flipped,
-            outputBuffer);
+        if(fast) {
+            fastMethod(
+                inputBufferContext.getHalideBuffer(),
+                shadingMapBuffer[0],
+                shadingMapBuffer[1],
+                shadingMapBuffer[2],
+                shadingMapBuffer[3],
+                rawBuffer.metadata.asShot[0],
+                rawBuffer.metadata.asShot[1],
+                rawBuffer.metadata.asShot[2],
+                cameraToSrgbBuffer,
+                rawBuffer.width / 2 / downscaleFactor,
+                rawBuffer.height / 2 / downscaleFactor,
+                rawBuffer.rowStride,
+                static_cast<int>(rawBuffer.pixelFormat),
+                static_cast<int>(cameraMetadata.sensorArrangment),
+                cameraMetadata.blackLevel[0],
+                cameraMetadata.blackLevel[1],
+                cameraMetadata.blackLevel[2],
+                cameraMetadata.blackLevel[3],
+                static_cast<uint16_t>(cameraMetadata.whiteLevel),
+                settings.shadows,
+                settings.whitePoint,
+                0.25f,
+                settings.blacks,
+                settings.exposure,
+                settings.contrast,
+                settings.saturation,
+                settings.flipped,
+                outputBuffer);
+        }
+        else {
+            method(
+                inputBufferContext.getHalideBuffer(),
+                shadingMapBuffer[0],
+                shadingMapBuffer[1],
+                shadingMapBuffer[2],
+                shadingMapBuffer[3],
+                rawBuffer.metadata.asShot[0],
+                rawBuffer.metadata.asShot[1],
+                rawBuffer.metadata.asShot[2],
+                cameraToSrgbBuffer,
+                rawBuffer.width / 2 / downscaleFactor,
+                rawBuffer.height / 2 / downscaleFactor,
+                rawBuffer.rowStride,
+                static_cast<int>(rawBuffer.pixelFormat),
+                static_cast<int>(cameraMetadata.sensorArrangment),
+                cameraMetadata.blackLevel[0],
+                cameraMetadata.blackLevel[1],
+                cameraMetadata.blackLevel[2],
+                cameraMetadata.blackLevel[3],
+                static_cast<uint16_t>(cameraMetadata.whiteLevel),
+                settings.shadows,
+                settings.whitePoint,
+                0.25f,
+                settings.blacks,
+                settings.exposure,
+                settings.contrast,
+                settings.blues,
+                settings.greens,
+                settings.saturation,
+                settings.sharpen0,
+                settings.sharpen1,
+                settings.pop,
+                settings.flipped,
+                outputBuffer);
+        }
 
         outputBuffer.device_sync();
         outputBuffer.copy_to_host();
@@ -785,9 +1008,54 @@ namespace motioncam {
         return rawData;
     }
 
+    Halide::Runtime::Buffer<uint8_t> ImageProcessor::loadPreviewImage(const RawImageBuffer& rawBuffer,
+                                                                      const RawCameraMetadata& cameraMetadata,
+                                                                      const int downscale,
+                                                                      const float scalePreview)
+    {
+        // Same as the preview from loadRawImage() without extended edges, sampled every 'downscale' pixels
+        const int width  = rawBuffer.width / 2 / downscale;
+        const int height = rawBuffer.height / 2 / downscale;
+
+        NativeBufferContext inputBufferContext(*rawBuffer.data, false);
+        Halide::Runtime::Buffer<uint8_t> previewBuffer(width, height);
+
+        fast_preview(inputBufferContext.getHalideBuffer(),
+                     rawBuffer.rowStride,
+                     static_cast<int>(rawBuffer.pixelFormat),
+                     static_cast<int>(cameraMetadata.sensorArrangment),
+                     width,
+                     height,
+                     0,
+                     downscale,
+                     downscale,
+                     cameraMetadata.whiteLevel,
+                     cameraMetadata.blackLevel[0],
+                     cameraMetadata.blackLevel[1],
+                     cameraMetadata.blackLevel[2],
+                     cameraMetadata.blackLevel[3],
+                     scalePreview,
+                     previewBuffer);
+
+        return previewBuffer;
+    }
+
     void ImageProcessor::measureImage(RawImageBuffer& rawBuffer, const RawCameraMetadata& cameraMetadata, float& outSceneLuminosity)
     {
-//        Measure measure("measureImage");
+        outSceneLuminosity = measureStatistics(cameraMetadata, rawBuffer)->keyValue;
+    }
+
+    std::shared_ptr<ImageStatistics> ImageProcessor::measureStatistics(const RawCameraMetadata& cameraMetadata,
+                                                                       const RawImageBuffer& rawBuffer,
+                                                                       const int downscale)
+    {
+        // Reuse the statistics if they were measured on this frame already
+        auto cached = std::atomic_load(&rawBuffer.statistics);
+
+        if(cached && cached->timestampNs == rawBuffer.metadata.timestampNs && cached->downscale == downscale)
+            return cached;
+
+//        Measure measure("measureStatistics()");
 
         cv::Mat cameraToPcs;
         cv::Mat pcsToSrgb;
@@ -804,13 +1072,15 @@ namespace motioncam {
             shadingMapBuffer[i] = ToHalideBuffer<float>(rawBuffer.metadata.lensShadingMap[i]);
         }
 
-        int halfWidth  = rawBuffer.width / 2;
-        int halfHeight = rawBuffer.height / 2;
-
-        const int downscale = 4;
+        const int halfWidth  = rawBuffer.width / 2;
+        const int halfHeight = rawBuffer.height / 2;
 
         NativeBufferContext inputBufferContext(*rawBuffer.data, false);
-        Halide::Runtime::Buffer<uint32_t> histogramBuffer(2u << 7u);
+        Halide::Runtime::Buffer<uint32_t> histogramBuffer(256, 4);
+        Halide::Runtime::Buffer<uint32_t> clippedBuffer(4);
+
+        cv::Mat luma(halfHeight / downscale, halfWidth / downscale, CV_8U);
+        Halide::Runtime::Buffer<uint8_t> lumaBuffer = ToHalideBuffer<uint8_t>(luma);
 
         measure_image(inputBufferContext.getHalideBuffer(),
                       rawBuffer.rowStride,
@@ -832,24 +1102,213 @@ namespace motioncam {
                       shadingMapBuffer[2],
                       shadingMapBuffer[3],
                       static_cast<int>(cameraMetadata.sensorArrangment),
-                      histogramBuffer);
+                      histogramBuffer,
+                      clippedBuffer,
+                      lumaBuffer);
 
         histogramBuffer.device_sync();
         histogramBuffer.copy_to_host();
 
-        cv::Mat histogram(histogramBuffer.height(), histogramBuffer.width(), CV_32S, histogramBuffer.data());
+        auto statistics = std::make_shared<ImageStatistics>();
+        
+        const float totalPixels = static_cast<float>((halfWidth / downscale) * (halfHeight / downscale));
+
+        statistics->timestampNs = rawBuffer.metadata.timestampNs;
+        statistics->downscale = downscale;
+
+        // Normalise each histogram
+        for(int c = 0; c < 4; c++) {
+            cv::Mat histogram(1, histogramBuffer.width(), CV_32S, histogramBuffer.data() + c*histogramBuffer.stride(1));
+            cv::Mat normalised;
 
-        // Normalize
-        histogram.convertTo(histogram, CV_32F, 1.0 / (halfWidth/downscale * halfHeight/downscale));
+            histogram.convertTo(normalised, CV_32F, 1.0 / totalPixels);
 
-        outSceneLuminosity = 0;
+            if(c == 0)
+                statistics->luminance = normalised;
+            else
+                statistics->channels[c - 1] = normalised;
+        }
+
+        for(int c = 0; c < 4; c++) {
+            statistics->clipped[c] = clippedBuffer(c) / totalPixels;
+        }
+
+        // Same log average as estimateShadows()
+        float avgLuminance = 0.0f;
+        float total = 0.0f;
+
+        for(int i = 0; i < statistics->luminance.cols; i++) {
+            avgLuminance += statistics->luminance.at<float>(i) * log(1e-5 + i / 255.0f);
+            total += statistics->luminance.at<float>(i);
+        }
+
+        statistics->keyValue = exp(avgLuminance / (total + 1e-5f));
+
+        // Keep the luminance and its pyramid for face detection
+        statistics->luma = luma;
+        cv::buildPyramid(luma, statistics->lumaPyramid, LUMA_PYRAMID_LEVELS);
+
+        std::atomic_store(&rawBuffer.statistics, statistics);
+
+        return statistics;
     }
 
-    cv::Mat ImageProcessor::registerImage2(
-        const Halide::Runtime::Buffer<uint8_t>& referenceBuffer, const Halide::Runtime::Buffer<uint8_t>& toAlignBuffer)
+    // Prepares a pyramid level the same way cv::findTransformECC() does
+    static cv::Mat smoothRegistrationImage(const cv::Mat& input) {
+        cv::Mat output;
+        
+        input.convertTo(output, CV_32F);
+        cv::GaussianBlur(output, output, cv::Size(ECC_GAUSSIAN_SIZE, ECC_GAUSSIAN_SIZE), 0, 0);
+        
+        return output;
+    }
+
+    //
+    // ECC homography solver (Evangelidis & Psarakis) following cv::findTransformECC(), except the gradients of the
+    // image are passed in so they can be shared between calls. Template coordinates are mapped to image coordinates.
+    //
+    
+    static bool findHomographyECC(const cv::Mat& templateImage,
+                                  const cv::Mat& image,
+                                  const cv::Mat& gradientX,
+                                  const cv::Mat& gradientY,
+                                  const cv::TermCriteria& termCriteria,
+                                  cv::Mat& warpMatrix)
     {
-        Measure measure("registerImage2()");
+        const cv::Size size = templateImage.size();
+        const int flags = cv::INTER_LINEAR + cv::WARP_INVERSE_MAP;
+        
+        cv::Mat x(1, size.width, CV_32F);
+        cv::Mat y(size.height, 1, CV_32F);
+        
+        for(int i = 0; i < size.width; i++)
+            x.at<float>(i) = static_cast<float>(i);
 
+        for(int i = 0; i < size.height; i++)
+            y.at<float>(i) = static_cast<float>(i);
+
+        cv::Mat xGrid, yGrid;
+        
+        cv::repeat(x, size.height, 1, xGrid);
+        cv::repeat(y, 1, size.width, yGrid);
+        
+        const cv::Mat valid = cv::Mat::ones(image.size(), CV_8U);
+        
+        cv::Mat imageWarped, gradientXWarped, gradientYWarped, mask;
+        
+        double rho = -1;
+        double lastRho = -termCriteria.epsilon;
+        
+        for(int i = 0; i < termCriteria.maxCount && std::fabs(rho - lastRho) >= termCriteria.epsilon; i++) {
+            cv::warpPerspective(image, imageWarped, warpMatrix, size, flags);
+            cv::warpPerspective(gradientX, gradientXWarped, warpMatrix, size, flags);
+            cv::warpPerspective(gradientY, gradientYWarped, warpMatrix, size, flags);
+            cv::warpPerspective(valid, mask, warpMatrix, size, cv::INTER_NEAREST + cv::WARP_INVERSE_MAP);
+            
+            const cv::Mat invalid = (mask == 0);
+            
+            imageWarped.setTo(0, invalid);
+            gradientXWarped.setTo(0, invalid);
+            gradientYWarped.setTo(0, invalid);
+            
+            cv::Scalar templateMean, templateStd, imageMean, imageStd;
+            
+            cv::meanStdDev(templateImage, templateMean, templateStd, mask);
+            cv::meanStdDev(imageWarped, imageMean, imageStd, mask);
+            
+            cv::Mat templateZeroMean = cv::Mat::zeros(size, CV_32F);
+            
+            cv::subtract(templateImage, templateMean, templateZeroMean, mask);
+            cv::subtract(imageWarped, imageMean, imageWarped, mask);
+            
+            const double validPixels = cv::countNonZero(mask);
+            const double templateNorm = std::sqrt(validPixels) * templateStd[0];
+            const double imageNorm = std::sqrt(validPixels) * imageStd[0];
+            
+            // Jacobian of the warped image with respect to the eight homography parameters
+            const float* m = warpMatrix.ptr<float>();
+            
+            cv::Mat den = xGrid*m[6] + yGrid*m[7] + 1.0f;
+            cv::Mat hatX, hatY, gx, gy;
+            
+            cv::divide(-(xGrid*m[0] + yGrid*m[1] + m[2]), den, hatX);
+            cv::divide(-(xGrid*m[3] + yGrid*m[4] + m[5]), den, hatY);
+            cv::divide(gradientXWarped, den, gx);
+            cv::divide(gradientYWarped, den, gy);
+            
+            cv::Mat t = hatX.mul(gx) + hatY.mul(gy);
+            
+            const cv::Mat jacobian[8] = {
+                xGrid.mul(gx), yGrid.mul(gx), gx,
+                xGrid.mul(gy), yGrid.mul(gy), gy,
+                xGrid.mul(t),  yGrid.mul(t)
+            };
+            
+            cv::Mat hessian(8, 8, CV_64F);
+            cv::Mat imageProjection(8, 1, CV_64F);
+            cv::Mat templateProjection(8, 1, CV_64F);
+            
+            for(int j = 0; j < 8; j++) {
+                for(int k = j; k < 8; k++) {
+                    hessian.at<double>(j, k) = hessian.at<double>(k, j) = jacobian[j].dot(jacobian[k]);
+                }
+                
+                imageProjection.at<double>(j) = jacobian[j].dot(imageWarped);
+                templateProjection.at<double>(j) = jacobian[j].dot(templateZeroMean);
+            }
+            
+            const cv::Mat hessianInv = hessian.inv();
+            const double correlation = templateZeroMean.dot(imageWarped);
+            
+            lastRho = rho;
+            rho = correlation / (imageNorm * templateNorm);
+            
+            if(std::isnan(rho))
+                return false;
+            
+            const cv::Mat imageProjectionHessian = hessianInv * imageProjection;
+            
+            const double lambdaN = imageNorm*imageNorm - imageProjection.dot(imageProjectionHessian);
+            const double lambdaD = correlation - templateProjection.dot(imageProjectionHessian);
+            
+            if(lambdaD <= 0)
+                return false;
+            
+            // Projection of the error image, lambda * template - image, without forming it
+            const cv::Mat errorProjection = (lambdaN / lambdaD) * templateProjection - imageProjection;
+            const cv::Mat deltaP = hessianInv * errorProjection;
+            
+            float* p = warpMatrix.ptr<float>();
+            
+            for(int j = 0; j < 8; j++)
+                p[j] += static_cast<float>(deltaP.at<double>(j));
+        }
+        
+        return true;
+    }
+
+    void ImageProcessor::buildRegistrationPyramid(const Halide::Runtime::Buffer<uint8_t>& buffer, RegistrationPyramid& outPyramid) {
+        static const cv::Mat dx = (cv::Mat_<float>(1, 3) << -0.5f, 0.0f, 0.5f);
+
+        cv::Mat image(buffer.height(), buffer.width(), CV_8U, (void*) buffer.data());
+        vector<cv::Mat> pyramid;
+        
+        cv::buildPyramid(image, pyramid, ALIGN_PYRAMID_LEVELS);
+        
+        outPyramid.images.assign(pyramid.size(), cv::Mat());
+        outPyramid.gradientX.assign(pyramid.size(), cv::Mat());
+        outPyramid.gradientY.assign(pyramid.size(), cv::Mat());
+        
+        for(size_t i = 1; i < pyramid.size(); i++) {
+            outPyramid.images[i] = smoothRegistrationImage(pyramid[i]);
+            
+            cv::filter2D(outPyramid.images[i], outPyramid.gradientX[i], -1, dx);
+            cv::filter2D(outPyramid.images[i], outPyramid.gradientY[i], -1, dx.t());
+        }
+    }
+
+    cv::Mat ImageProcessor::registerImage2(const RegistrationPyramid& reference, const Halide::Runtime::Buffer<uint8_t>& toAlignBuffer)
+    {
         static const cv::TermCriteria termCriteria = cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, 50, 0.0001f);
 
         static const float scaleWarpMatrix[] = {
@@ -859,19 +1318,14 @@ namespace motioncam {
 
         static const cv::Mat s(3, 3, CV_32F, (void*) &scaleWarpMatrix);
 
-        cv::Mat referenceImage(referenceBuffer.height(), referenceBuffer.width(), CV_8U, (void*) referenceBuffer.data());
         cv::Mat toAlignImage(toAlignBuffer.height(), toAlignBuffer.width(), CV_8U, (void*) toAlignBuffer.data());
 
-        const int ALIGN_PYRAMID_LEVELS = 5;
-    
-        // Create pyramid from reference
-        vector<cv::Mat> refPyramid;
-       
-        cv::buildPyramid(referenceImage, refPyramid, ALIGN_PYRAMID_LEVELS);
-
         vector<cv::Mat> curPyramid;
         cv::buildPyramid(toAlignImage, curPyramid, ALIGN_PYRAMID_LEVELS);
 
+        if(curPyramid.size() != reference.images.size())
+            return cv::Mat();
+
         cv::Mat warpMatrix = cv::Mat::eye(3, 3, CV_32F);
 
         //
@@ -880,44 +1334,97 @@ namespace motioncam {
         //
 
         for(int i = (int) curPyramid.size() - 1; i > 0; i--) {
-            try {
-                cv::findTransformECC(curPyramid[i], refPyramid[i], warpMatrix, cv::MOTION_HOMOGRAPHY, termCriteria);
-            }
-            catch(cv::Exception& e) {
+            if(!findHomographyECC(smoothRegistrationImage(curPyramid[i]),
+                                  reference.images[i],
+                                  reference.gradientX[i],
+                                  reference.gradientY[i],
+                                  termCriteria,
+                                  warpMatrix))
+            {
                 return cv::Mat();
             }
             
-            if(i > 0)
-                warpMatrix = warpMatrix.mul(s);
+            warpMatrix = warpMatrix.mul(s);
         }
         
         return warpMatrix;
     }
 
+    cv::Mat ImageProcessor::registerImage2(
+        const Halide::Runtime::Buffer<uint8_t>& referenceBuffer, const Halide::Runtime::Buffer<uint8_t>& toAlignBuffer)
+    {
+        Measure measure("registerImage2()");
+
+        RegistrationPyramid reference;
+        
+        buildRegistrationPyramid(referenceBuffer, reference);
+        
+        return registerImage2(reference, toAlignBuffer);
+    }
+
+    std::vector<cv::Mat> ImageProcessor::registerImages2(const Halide::Runtime::Buffer<uint8_t>& referenceBuffer,
+                                                         const std::vector<Halide::Runtime::Buffer<uint8_t>>& toAlignBuffers)
+    {
+        Measure measure("registerImages2()");
+
+        RegistrationPyramid reference;
+        
+        buildRegistrationPyramid(referenceBuffer, reference);
+        
+        std::vector<cv::Mat> result(toAlignBuffers.size());
+        
+        cv::parallel_for_(cv::Range(0, static_cast<int>(toAlignBuffers.size())), [&](const cv::Range& range) {
+            for(int i = range.start; i < range.end; i++) {
+                result[i] = registerImage2(reference, toAlignBuffers[i]);
+            }
+        });
+        
+        return result;
+    }
+
     cv::Mat ImageProcessor::registerImage(
         const Halide::Runtime::Buffer<uint8_t>& referenceBuffer, const Halide::Runtime::Buffer<uint8_t>& toAlignBuffer)
     {
-        Measure measure("registerImage()");
+        RegistrationFeatures reference;
 
-        cv::Mat referenceImage(referenceBuffer.height(), referenceBuffer.width(), CV_8U, (void*) referenceBuffer.data());
-        cv::Mat toAlignImage(toAlignBuffer.height(), toAlignBuffer.width(), CV_8U, (void*) toAlignBuffer.data());
+        detectFeatures(referenceBuffer, reference);
 
-        auto detector = cv::ORB::create();
+        return registerImage(reference, toAlignBuffer);
+    }
 
-        std::vector<cv::KeyPoint> keypoints1, keypoints2;
-        cv::Mat descriptors1, descriptors2;
+    void ImageProcessor::detectFeatures(const Halide::Runtime::Buffer<uint8_t>& buffer, RegistrationFeatures& outFeatures)
+    {
+        cv::Mat image(buffer.height(), buffer.width(), CV_8U, (void*) buffer.data());
+
+        auto detector = cv::ORB::create();
         auto extractor = cv::xfeatures2d::BriefDescriptorExtractor::create();
 
-        detector->detect(referenceImage, keypoints1);
-        detector->detect(toAlignImage, keypoints2);
+        detector->detect(image, outFeatures.keypoints);
+        extractor->compute(image, outFeatures.keypoints, outFeatures.descriptors);
+    }
+
+    cv::Mat ImageProcessor::registerImage(
+        const RegistrationFeatures& reference, const Halide::Runtime::Buffer<uint8_t>& toAlignBuffer, const FeatureMatcher matcher)
+    {
+        Measure measure("registerImage()");
+
+        RegistrationFeatures toAlign;
 
-        extractor->compute(referenceImage, keypoints1, descriptors1);
-        extractor->compute(toAlignImage, keypoints2, descriptors2);
+        detectFeatures(toAlignBuffer, toAlign);
+
+        if(reference.descriptors.empty() || toAlign.descriptors.empty())
+            return cv::Mat();
+
+        cv::Ptr<cv::DescriptorMatcher> descriptorMatcher;
+
+        if(matcher == FeatureMatcher::LSH)
+            descriptorMatcher = cv::makePtr<cv::FlannBasedMatcher>(cv::makePtr<cv::flann::LshIndexParams>(6, 12, 1));
+        else
+            descriptorMatcher = cv::BFMatcher::create(cv::NORM_HAMMING, false);
 
-        auto matcher = cv::BFMatcher::create(cv::NORM_HAMMING, false);
         std::vector< std::vector<cv::DMatch> > knn_matches;
 
-        matcher->knnMatch( descriptors1, descriptors2, knn_matches, 2 );
+        descriptorMatcher->knnMatch( reference.descriptors, toAlign.descriptors, knn_matches, 2 );
 
         // Filter matches using the Lowe's ratio test
         const float ratioThresh = 0.75f;
@@ -925,7 +1432,8 @@ namespace motioncam {
 
         for (auto& m : knn_matches)
         {
-            if (m[0].distance < ratioThresh * m[1].distance)
+            // LSH can return fewer than two neighbours
+            if (m.size() == 2 && m[0].distance < ratioThresh * m[1].distance)
                 goodMatches.push_back(m[0]);
         }
 
@@ -934,11 +1442,12 @@ namespace motioncam {
 
         for(auto& m : goodMatches)
         {
-            obj.push_back( keypoints1[ m.queryIdx ].pt );
-            scene.push_back( keypoints2[ m.trainIdx ].pt );
+            obj.push_back( reference.keypoints[ m.queryIdx ].pt );
+            scene.push_back( toAlign.keypoints[ m.trainIdx ].pt );
         }
 
-        if(obj.empty()) {
+        // Need at least four points for a homography
+        if(obj.size() < 4) {
             return cv::Mat();
         }
 
@@ -951,52 +1460,7 @@ namespace motioncam {
                                           const int downscale)
     {
         //Measure measure("calcHistogram()");
-        const int halfWidth  = buffer.width / 2;
-        const int halfHeight = buffer.height / 2;
-
-        NativeBufferContext inputBufferContext(*buffer.data, false);
-        Halide::Runtime::Buffer<float> shadingMapBuffer[4];
-        Halide::Runtime::Buffer<uint32_t> histogramBuffer(2u << 7u);
-
-        cv::Mat cameraToPcs;
-        cv::Mat pcsToSrgb;
-        cv::Vec3f cameraWhite;
-        
-        createSrgbMatrix(cameraMetadata, buffer.metadata, buffer.metadata.asShot, cameraWhite, cameraToPcs, pcsToSrgb);
-
-        cv::Mat cameraToSrgb = pcsToSrgb * cameraToPcs;
-
-        Halide::Runtime::Buffer<float> cameraToSrgbBuffer = ToHalideBuffer<float>(cameraToSrgb);
-
-        for(int i = 0; i < 4; i++) {
-            shadingMapBuffer[i] = ToHalideBuffer<float>(buffer.metadata.lensShadingMap[i]);
-        }
-
-        measure_image(inputBufferContext.getHalideBuffer(),
-                      buffer.rowStride,
-                      static_cast<int>(buffer.pixelFormat),
-                      halfWidth,
-                      halfHeight,
-                      downscale,
-                      cameraMetadata.blackLevel[0],
-                      cameraMetadata.blackLevel[1],
-                      cameraMetadata.blackLevel[2],
-                      cameraMetadata.blackLevel[3],
-                      cameraMetadata.whiteLevel,
-                      cameraWhite[0],
-                      cameraWhite[1],
-                      cameraWhite[2],
-                      cameraToSrgbBuffer,
-                      shadingMapBuffer[0],
-                      shadingMapBuffer[1],
-                      shadingMapBuffer[2],
-                      shadingMapBuffer[3],
-                      static_cast<int>(cameraMetadata.sensorArrangment),
-                      histogramBuffer);
-        
-        cv::Mat histogram(histogramBuffer.height(), histogramBuffer.width(), CV_32S, histogramBuffer.data());
-        
-        histogram.convertTo(histogram, CV_32F);
+        cv::Mat histogram = measureStatistics(cameraMetadata, buffer, downscale)->luminance.clone();
         
         if(cumulative) {
             for(int i = 1; i < histogram.cols; i++) {
@@ -1005,47 +1469,38 @@ namespace motioncam {
             
             histogram /= histogram.at<float>(histogram.cols - 1);
         }
-        else {
-            for(int i = 0; i < histogram.cols; i++) {
-                histogram.at<float>(i) /= (halfWidth/downscale * halfHeight/downscale);
-            }
-        }
         
         return histogram;
     }
 
-    void ImageProcessor::matchExposures(
-        const RawCameraMetadata& cameraMetadata, const RawImageBuffer& reference, const RawImageBuffer& toMatch, float& outScale, float& outWhitePoint)
+    // Matches two cumulative histograms. Both are monotone so the reference is walked once alongside the other
+    // histogram instead of being searched from the start for every bin.
+    static void matchCumulativeHistograms(const cv::Mat& refHistogram, const cv::Mat& toMatchHistogram, float& outScale, float& outWhitePoint)
     {
-        auto refHistogram = calcHistogram(cameraMetadata, reference, true, 4);
-        auto toMatchHistogram = calcHistogram(cameraMetadata, toMatch, true, 4);
-        
         std::vector<float> matches;
         
+        int j = 1;
+        
         for(int i = 0; i < toMatchHistogram.cols; i++) {
             float a = toMatchHistogram.at<float>(i);
 
-            for(int j = 1; j < refHistogram.cols; j++) {
-                float b = refHistogram.at<float>(j);
-
-                if(a <= b) {
-                    double match = j / (i + 1.0);
-                    matches.push_back(match);
-                    break;
-                }
-            }
+            while(j < refHistogram.cols && refHistogram.at<float>(j) < a)
+                j++;
+            
+            // Later bins can't match either
+            if(j >= refHistogram.cols)
+                break;
+            
+            matches.push_back(j / (i + 1.0f));
         }
         
-        outWhitePoint = 1.0f;
+        // Last bin below the threshold
+        const float* begin = toMatchHistogram.ptr<float>();
+        const float* end = begin + toMatchHistogram.cols;
         
-        for(int i = toMatchHistogram.cols - 1; i >= 0; i--) {
-            float a = toMatchHistogram.at<float>(i);
-            if(a < WHITEPOINT_THRESHOLD) {
-                outWhitePoint = toMatchHistogram.cols / (float) (i + 1);
-                break;
-            }
-                
-        }
+        int whiteBin = static_cast<int>(std::lower_bound(begin, end, WHITEPOINT_THRESHOLD) - begin) - 1;
+        
+        outWhitePoint = whiteBin >= 0 ? toMatchHistogram.cols / (float) (whiteBin + 1) : 1.0f;
         
         float scale = 0;
         
@@ -1062,6 +1517,36 @@ namespace motioncam {
             outScale = scale / (float) (Imax - Imin);
     }
 
+    void ImageProcessor::matchExposures(
+        const RawCameraMetadata& cameraMetadata, const RawImageBuffer& reference, const RawImageBuffer& toMatch, float& outScale, float& outWhitePoint)
+    {
+        auto refHistogram = calcHistogram(cameraMetadata, reference, true, 4);
+        auto toMatchHistogram = calcHistogram(cameraMetadata, toMatch, true, 4);
+        
+        matchCumulativeHistograms(refHistogram, toMatchHistogram, outScale, outWhitePoint);
+    }
+
+    void ImageProcessor::matchExposures(const RawCameraMetadata& cameraMetadata,
+                                        const RawImageBuffer& reference,
+                                        const std::vector<std::shared_ptr<RawImageBuffer>>& toMatch,
+                                        std::vector<float>& outScales,
+                                        std::vector<float>& outWhitePoints)
+    {
+        // Reference is measured once and shared by all brackets
+        auto refHistogram = calcHistogram(cameraMetadata, reference, true, 4);
+        
+        outScales.assign(toMatch.size(), 1.0f);
+        outWhitePoints.assign(toMatch.size(), 1.0f);
+        
+        cv::parallel_for_(cv::Range(0, static_cast<int>(toMatch.size())), [&](const cv::Range& range) {
+            for(int i = range.start; i < range.end; i++) {
+                auto toMatchHistogram = calcHistogram(cameraMetadata, *toMatch[i], true, 4);
+                
+                matchCumulativeHistograms(refHistogram, toMatchHistogram, outScales[i], outWhitePoints[i]);
+            }
+        });
+    }
+
     void ImageProcessor::process(RawContainer& rawContainer, const std::string& outputPath, const ImageProcessorProgress& progressListener)
     {
         cv::ocl::setUseOpenCL(false);
@@ -1091,6 +1576,9 @@ namespace motioncam {
                 }
             }
         }
+
+        // Drop the frames not worth merging. Done here rather than when saving so it doesn't hold up the camera.
+        BurstSelector::filter(rawContainer);
                                 
         // Estimate shadows if not set
         if(settings.shadows < 0) {
@@ -1127,6 +1615,9 @@ namespace motioncam {
         cv::cvtColor(previewImage, previewImage, cv::COLOR_RGBA2BGR);
         cv::imwrite(previewPath, previewImage);
         
+        // Reuse the downscaled preview for the exif thumbnail
+        cv::Mat thumbnail = CreateThumbnail(previewImage, referenceRawBuffer->metadata.screenOrientation, settings.flipped);
+        
         // Parse the returned metadata
         std::string metadataJson = progressListener.onPreviewSaved(previewPath);
         previewImage.release();
@@ -1216,6 +1707,17 @@ namespace motioncam {
             }
         }
         
+        std::vector<uint8_t> exifData;
+        
+        createExifData(exifMetadata,
+                       thumbnail,
+                       rawContainer.getCameraMetadata(),
+                       rawContainer.getPostProcessSettings(),
+                       exifData);
+        
+        // 16-bit TIFF output is selected by the file extension
+        const int outputType = IsTiffPath(outputPath) ? CV_16UC3 : CV_8UC3;
+        
         cv::Mat outputImage = postProcess(
             denoiseOutput,
             hdrMetadata,
@@ -1224,28 +1726,25 @@ namespace motioncam {
             noise,
             referenceRawBuffer->metadata,
             rawContainer.getCameraMetadata(),
-            settings);
+            settings,
+            outputType);
         
         progressHelper.postProcessCompleted();
-         
-        // Write image
-        std::vector<int> writeParams = { cv::IMWRITE_JPEG_QUALITY, rawContainer.getPostProcessSettings().jpegQuality };
-        cv::imwrite(outputPath, outputImage, writeParams);
-
-        // Create thumbnail
-        cv::Mat thumbnail;
-
-        int width = 320;
-        int height = (int) std::lround((outputImage.rows / (double) outputImage.cols) * width);
-
-        cv::resize(outputImage, thumbnail, cv::Size(width, height));
-
-        // Add exif data to the output image
-        addExifMetadata(exifMetadata,
-                        thumbnail,
-                        rawContainer.getCameraMetadata(),
-                        rawContainer.getPostProcessSettings(),
-                        outputPath);
+        
+        if(outputType == CV_16UC3) {
+            util::TiffStripWriter writer(outputPath, outputImage.cols, outputImage.rows);
+            
+            writer.write(outputImage);
+            writer.commit();
+        }
+        else {
+            // Write image with exif data in a single pass
+            util::JpegStripWriter writer(outputPath, outputImage.cols, outputImage.rows, rawContainer.getPostProcessSettings().jpegQuality);
+            
+            writer.setExif(exifData);
+            writer.write(outputImage);
+            writer.commit();
+        }
         
         progressHelper.imageSaved();
     }
@@ -1297,20 +1796,12 @@ namespace motioncam {
 //        return std::min(4.0f, std::max(1.0f, 128.0f / L));
     }
     
-    void ImageProcessor::addExifMetadata(const RawImageMetadata& metadata,
-                                         const cv::Mat& thumbnail,
-                                         const RawCameraMetadata& cameraMetadata,
-                                         const PostProcessSettings& settings,
-                                         const std::string& inputOutput)
+    static void FillExifData(const RawImageMetadata& metadata,
+                             const cv::Mat& thumbnail,
+                             const RawCameraMetadata& cameraMetadata,
+                             const PostProcessSettings& settings,
+                             Exiv2::ExifData& exifData)
     {
-        auto image = Exiv2::ImageFactory::open(inputOutput);
-        if(image.get() == nullptr)
-            return;
-        
-        image->readMetadata();
-        
-        Exiv2::ExifData& exifData = image->exifData();
-        
         // sRGB color space
         exifData["Exif.Photo.ColorSpace"]       = uint16_t(1);
         
@@ -1380,8 +1871,22 @@ namespace motioncam {
             
             exifThumb.setJpegThumbnail(thumbnailBuffer.data(), thumbnailBuffer.size());
         }
+    }
+    
+    void ImageProcessor::createExifData(const RawImageMetadata& metadata,
+                                        const cv::Mat& thumbnail,
+                                        const RawCameraMetadata& cameraMetadata,
+                                        const PostProcessSettings& settings,
+                                        std::vector<uint8_t>& outExifData)
+    {
+        Exiv2::ExifData exifData;
+        Exiv2::Blob blob;
+        
+        FillExifData(metadata, thumbnail, cameraMetadata, settings, exifData);
         
-        image->writeMetadata();
+        Exiv2::ExifParser::encode(blob, Exiv2::littleEndian, exifData);
+        
+        outExifData.assign(blob.begin(), blob.end());
     }
 
     double ImageProcessor::measureSharpness(const RawImageBuffer& rawBuffer) {
@@ -1600,93 +2105,204 @@ namespace motioncam {
     std::shared_ptr<HdrMetadata> ImageProcessor::prepareHdr(const RawCameraMetadata& cameraMetadata,
                                                             const PostProcessSettings& settings,
                                                             const RawImageBuffer& reference,
-                                                            const std::vector<std::shared_ptr<RawImageBuffer>>& underexposed)
+                                                            const std::vector<std::shared_ptr<RawImageBuffer>>& underexposed,
+                                                            const FeatureMatcher matcher)
     {
         Measure measure("prepareHdr()");
         
         if(underexposed.empty())
             return nullptr;
         
-        auto refImage = loadRawImage(reference, cameraMetadata, true, 1.0);
+        //
+        // Decide on HDR from low resolution previews so rejected captures are never loaded at full resolution
+        //
+
+        auto refPreview = loadPreviewImage(reference, cameraMetadata, HDR_PREVIEW_DOWNSCALE);
         
-        // Align to reference
-        std::vector<std::shared_ptr<RawData>> images;
+        // Reference features are the same for every bracket
+        RegistrationFeatures referenceFeatures;
+
+        detectFeatures(refPreview, referenceFeatures);
+
+        // Align brackets to the reference in parallel
+        std::vector<Halide::Runtime::Buffer<uint8_t>> loadedPreviews(underexposed.size());
+        std::vector<cv::Mat> loadedWarpMatrices(underexposed.size());
+        std::vector<float> loadedScales(underexposed.size());
+
+        const auto referenceEv = calcEv(cameraMetadata, reference.metadata);
+
+        cv::parallel_for_(cv::Range(0, static_cast<int>(underexposed.size())), [&](const cv::Range& range) {
+            for(int i = range.start; i < range.end; i++) {
+                auto ev = calcEv(cameraMetadata, underexposed[i]->metadata);
+
+                loadedScales[i] = std::pow(2.0f, std::abs(ev - referenceEv));
+                loadedPreviews[i] = loadPreviewImage(*underexposed[i], cameraMetadata, HDR_PREVIEW_DOWNSCALE, loadedScales[i]);
+                loadedWarpMatrices[i] = registerImage(referenceFeatures, loadedPreviews[i], matcher);
+            }
+        });
+
+        std::vector<std::shared_ptr<RawImageBuffer>> brackets;
+        std::vector<Halide::Runtime::Buffer<uint8_t>> previews;
         std::vector<cv::Mat> warpMatrixList;
+        std::vector<float> scales;
 
-        float exposureScale = 1.0f;
+        float exposureScale = std::pow(2.0f, std::abs(calcEv(cameraMetadata, underexposed.back()->metadata) - referenceEv));
         
         for(int i = 0; i < underexposed.size(); i++) {
-            auto a = calcEv(cameraMetadata, reference.metadata);
-            auto b = calcEv(cameraMetadata, underexposed[i]->metadata);
-
-            exposureScale = std::pow(2.0f, std::abs(b - a));
-            auto underexposedImage = loadRawImage(*underexposed[i], cameraMetadata, true, exposureScale);
-            auto warpMatrix = registerImage(refImage->previewBuffer, underexposedImage->previewBuffer);
-                 
             // Ignore if we can't align
-            if(warpMatrix.empty())
+            if(loadedWarpMatrices[i].empty())
                 continue;
             
-            warpMatrixList.push_back(warpMatrix);
-            images.push_back(underexposedImage);
-            
-            underexposed[i]->data.release();
+            brackets.push_back(underexposed[i]);
+            previews.push_back(loadedPreviews[i]);
+            warpMatrixList.push_back(loadedWarpMatrices[i]);
+            scales.push_back(loadedScales[i]);
+        }
+
+        loadedPreviews.clear();
+
+        if(brackets.empty()) {
+            logger::log("Failed to align HDR images");
+            return nullptr;
         }
         
         //
         // Test alignment
         //
         
-        cv::Mat finalGhostMap(images[0]->previewBuffer.height(), images[0]->previewBuffer.width(), CV_8U);
-        
-        finalGhostMap.setTo(1);
-        
-        for(int i = 0; i < images.size(); i++) {
-            cv::Mat misaligned(images[i]->previewBuffer.height(), images[i]->previewBuffer.width(), CV_8U, images[i]->previewBuffer.data());
-            cv::Mat aligned;
-            
-            cv::warpPerspective(misaligned, aligned, warpMatrixList[i], aligned.size(), cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+        // Only the first brackets are merged so the rest don't need to line up
+        if(brackets.size() > MAX_HDR_BRACKETS) {
+            brackets.resize(MAX_HDR_BRACKETS);
+            previews.resize(MAX_HDR_BRACKETS);
+            warpMatrixList.resize(MAX_HDR_BRACKETS);
+            scales.resize(MAX_HDR_BRACKETS);
+        }
 
-            Halide::Runtime::Buffer<uint8_t> alignedBuffer = ToHalideBuffer<uint8_t>(aligned);
-            Halide::Runtime::Buffer<uint8_t> ghostMapBuffer(alignedBuffer.width(), alignedBuffer.height());
-            
-            hdr_mask(refImage->previewBuffer, alignedBuffer, 16.0f, ghostMapBuffer);
-            
-            cv::Mat ghostMap(ghostMapBuffer.height(), ghostMapBuffer.width(), CV_8U, ghostMapBuffer.data());
+        // Warp the previews and combine their ghost maps in a single pass
+        std::vector<cv::Mat> inverseWarpMatrices;
+        std::vector<Halide::Runtime::Buffer<float>> warpBuffers;
+
+        for(auto& warpMatrix : warpMatrixList) {
+            cv::Mat inverseWarpMatrix;
+
+            warpMatrix.inv().convertTo(inverseWarpMatrix, CV_32F);
+
+            inverseWarpMatrices.push_back(inverseWarpMatrix);
+            warpBuffers.push_back(ToHalideBuffer<float>(inverseWarpMatrix));
+        }
+
+        const int previewWidth = refPreview.width();
+        const int previewHeight = refPreview.height();
 
-            finalGhostMap &= ghostMap;
+        Halide::Runtime::Buffer<uint8_t> ghostMapBuffer(previewWidth, previewHeight);
+        Halide::Runtime::Buffer<float> errorBuffer = Halide::Runtime::Buffer<float>::make_scalar();
+
+        switch(previews.size()) {
+            case 1:
+                hdr_ghost_mask1(refPreview,
+                                previews[0],
+                                warpBuffers[0],
+                                previewWidth, previewHeight, 16.0f, ghostMapBuffer, errorBuffer);
+                break;
+
+            case 2:
+                hdr_ghost_mask2(refPreview,
+                                previews[0], previews[1],
+                                warpBuffers[0], warpBuffers[1],
+                                previewWidth, previewHeight, 16.0f, ghostMapBuffer, errorBuffer);
+                break;
+
+            case 3:
+                hdr_ghost_mask3(refPreview,
+                                previews[0], previews[1], previews[2],
+                                warpBuffers[0], warpBuffers[1], warpBuffers[2],
+                                previewWidth, previewHeight, 16.0f, ghostMapBuffer, errorBuffer);
+                break;
+
+            default:
+                hdr_ghost_mask4(refPreview,
+                                previews[0], previews[1], previews[2], previews[3],
+                                warpBuffers[0], warpBuffers[1], warpBuffers[2], warpBuffers[3],
+                                previewWidth, previewHeight, 16.0f, ghostMapBuffer, errorBuffer);
+                break;
         }
 
-        float error = cv::mean(finalGhostMap)[0] * 100;
+        float error = errorBuffer();
         logger::log("HDR error: " + std::to_string(error));
         
         if(error >= MAX_HDR_ERROR)
             return nullptr;
         
-        // Need at least 4 images to contiue
-        while(images.size() < 4) {
-            images.push_back(images[images.size()-1]);
-            warpMatrixList.push_back(warpMatrixList[warpMatrixList.size()-1]);
-        }
-        
+        previews.clear();
+
+        //
+        // Load the accepted brackets at full resolution
+        //
+
+        std::vector<std::shared_ptr<RawData>> images(brackets.size());
+
+        cv::parallel_for_(cv::Range(0, static_cast<int>(brackets.size())), [&](const cv::Range& range) {
+            for(int i = range.start; i < range.end; i++) {
+                images[i] = loadRawImage(*brackets[i], cameraMetadata, true, scales[i]);
+            }
+        });
+
+        for(auto& bracket : brackets)
+            bracket->data.release();
+
         auto output = images[0]->rawBuffer.copy();
         
-        for(int i = 0; i < warpMatrixList.size(); i++) {
-            warpMatrixList[i] = warpMatrixList[i].inv();
-            warpMatrixList[i].convertTo(warpMatrixList[i], CV_32F);
+        const int rawWidth = images[0]->rawBuffer.width();
+        const int rawHeight = images[0]->rawBuffer.height();
+
+        // Move the warps from preview coordinates to the raw buffers, which are not downscaled and are offset by the
+        // extended edges
+        const float offsetX = (rawWidth - reference.width / 2) / 2;
+        const float offsetY = (rawHeight - reference.height / 2) / 2;
+
+        cv::Mat previewToRaw = (cv::Mat_<float>(3, 3) <<
+            HDR_PREVIEW_DOWNSCALE, 0, offsetX,
+            0, HDR_PREVIEW_DOWNSCALE, offsetY,
+            0, 0, 1);
+
+        cv::Mat rawToPreview = previewToRaw.inv();
+
+        std::vector<cv::Mat> rawWarpMatrices;
+        std::vector<Halide::Runtime::Buffer<float>> rawWarpBuffers;
+
+        for(auto& inverseWarpMatrix : inverseWarpMatrices) {
+            cv::Mat rawWarpMatrix = previewToRaw * inverseWarpMatrix * rawToPreview;
+
+            rawWarpMatrices.push_back(rawWarpMatrix);
+            rawWarpBuffers.push_back(ToHalideBuffer<float>(rawWarpMatrix));
+        }
+
+        // Only merge the brackets we have
+        switch(images.size()) {
+            case 1:
+                deghost1(images[0]->rawBuffer,
+                         rawWarpBuffers[0],
+                         rawWidth, rawHeight, output);
+                break;
+
+            case 2:
+                deghost2(images[0]->rawBuffer, images[1]->rawBuffer,
+                         rawWarpBuffers[0], rawWarpBuffers[1],
+                         rawWidth, rawHeight, output);
+                break;
+
+            case 3:
+                deghost3(images[0]->rawBuffer, images[1]->rawBuffer, images[2]->rawBuffer,
+                         rawWarpBuffers[0], rawWarpBuffers[1], rawWarpBuffers[2],
+                         rawWidth, rawHeight, output);
+                break;
+
+            default:
+                deghost(images[0]->rawBuffer, images[1]->rawBuffer, images[2]->rawBuffer, images[3]->rawBuffer,
+                        rawWarpBuffers[0], rawWarpBuffers[1], rawWarpBuffers[2], rawWarpBuffers[3],
+                        rawWidth, rawHeight, output);
+                break;
         }
-        
-        deghost(images[0]->rawBuffer,
-                images[1]->rawBuffer,
-                images[2]->rawBuffer,
-                images[3]->rawBuffer,
-                ToHalideBuffer<float>(warpMatrixList[0]),
-                ToHalideBuffer<float>(warpMatrixList[1]),
-                ToHalideBuffer<float>(warpMatrixList[2]),
-                ToHalideBuffer<float>(warpMatrixList[3]),
-                images[0]->rawBuffer.width(),
-                images[0]->rawBuffer.height(),
-                output);
         
         // Free memory
         images.clear();
@@ -1850,102 +2466,9 @@ namespace motioncam {
     }
 
     std::vector<cv::Rect2f> ImageProcessor::detectFaces(const RawImageBuffer& buffer, const RawCameraMetadata& cameraMetadata) {
-        Measure measure("detectFaces()");
-        
-        NativeBufferContext inputBufferContext(*buffer.data, false);
-        Halide::Runtime::Buffer<uint8_t> output;
-        
-        int scale = 4;
-        
-        if(buffer.metadata.screenOrientation == ScreenOrientation::LANDSCAPE ||
-           buffer.metadata.screenOrientation == ScreenOrientation::REVERSE_LANDSCAPE)
-        {
-            output = Halide::Runtime::Buffer<uint8_t>(buffer.width/scale, buffer.height/scale);
-        }
-        else {
-            output = Halide::Runtime::Buffer<uint8_t>(buffer.height/scale, buffer.width/scale);
-        }
-        
-        int rotation = 0;
-        switch(buffer.metadata.screenOrientation) {
-            case ScreenOrientation::PORTRAIT:
-                rotation = -90;
-                break;
-            case ScreenOrientation::REVERSE_PORTRAIT:
-                rotation = 90;
-                break;
-            case ScreenOrientation::REVERSE_LANDSCAPE:
-                rotation = 180;
-                break;
-                
-            default:
-            case ScreenOrientation::LANDSCAPE:
-                rotation = 0;
-        }
-        
-        fast_preview(inputBufferContext.getHalideBuffer(),
-                     buffer.rowStride,
-                     static_cast<int>(buffer.pixelFormat),
-                     static_cast<int>(cameraMetadata.sensorArrangment),
-                     buffer.width/scale,
-                     buffer.height/scale,
-                     rotation,
-                     scale/2,
-                     scale/2,
-                     cameraMetadata.whiteLevel,
-                     cameraMetadata.blackLevel[0],
-                     cameraMetadata.blackLevel[1],
-                     cameraMetadata.blackLevel[2],
-                     cameraMetadata.blackLevel[3],
-                     output);
+        // Shared between calls so faces are tracked from one frame to the next
+        static FaceDetector detector;
 
-        auto previewImage = cv::Mat(output.height(), output.width(), CV_8U, output.data());        
-        cv::equalizeHist(previewImage, previewImage);
-
-        static cv::CascadeClassifier c;
-        
-        if(c.empty()) {
-            cv::FileStorage fs;
-            auto classifier = cv::String(&lbpcascade_frontalface_improved_xml[0]);
-            
-            fs.open(classifier, cv::FileStorage::READ | cv::FileStorage::MEMORY);
-            
-            c.read(fs.getFirstTopLevelNode());
-        }
-
-        std::vector<cv::Rect> dets;
-        std::vector<cv::Rect2f> result;
-        
-        c.detectMultiScale(previewImage, dets, 1.5);
-        
-        for(int i = 0; i < dets.size(); i++) {
-            float x = dets[i].tl().x / (float) output.width();
-            float y = dets[i].tl().y / (float) output.height();
-            float width = dets[i].width / (float) output.width();
-            float height = dets[i].height / (float) output.height();
-
-            result.push_back(cv::Rect2f(x, y, width, height));
-        }
-
-//        static dlib::frontal_face_detector detector = dlib::get_frontal_face_detector();
-//
-//        std::vector<dlib::rectangle> dets;
-//        std::vector<cv::Rect2f> result;
-//
-//        dlib::array2d<dlib::uint8> dlibFrame;
-//        dlib::assign_image(dlibFrame, dlib::cv_image<dlib::uint8>(previewImage));
-//
-//        dets = detector(dlibFrame);
-//
-//        for(int i = 0; i < dets.size(); i++) {
-//            float left = dets[i].left() / (float) output.width();
-//            float right = dets[i].right() / (float) output.width();
-//            float top = dets[i].top() / (float) output.height();
-//            float bottom = dets[i].bottom() / (float) output.height();
-//
-//            result.push_back(cv::Rect2f(left, top, right - left, bottom - top));
-//        }
-
-        return result;
+        return detector.detect(buffer, cameraMetadata);
     }
 }
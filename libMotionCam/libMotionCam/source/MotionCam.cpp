@@ -2,6 +2,11 @@
 #include "motioncam/RawContainer.h"
 #include "motioncam/Util.h"
 #include "motioncam/ImageProcessor.h"
+#include "motioncam/RawImageMetadata.h"
+#include "motioncam/Settings.h"
+#include "motioncam/Exceptions.h"
+#include "motioncam/Logger.h"
+#include "motioncam/SettingsEstimator.h"
 
 #include "build_bayer.h"
 
@@ -10,9 +15,18 @@
 #include <queue/concurrentqueue.h>
 #include <queue/blockingconcurrentqueue.h>
 
+#include <json11/json11.hpp>
+
 #include <chrono>
+#include <cmath>
+#include <atomic>
 #include <thread>
+#include <mutex>
+#include <map>
+#include <cstdio>
+#include <ostream>
 #include <unistd.h>
+#include <sys/stat.h>
 
 namespace motioncam {
     struct Job {
@@ -34,21 +48,101 @@ namespace motioncam {
         std::string error;
     };
 
+    struct ConversionStats {
+        void reset() {
+            start = std::chrono::steady_clock::now();
+            
+            decodeNs    = 0;
+            bayerNs     = 0;
+            encodeNs    = 0;
+            writeNs     = 0;
+            frames      = 0;
+            bytes       = 0;
+        }
+        
+        static int64_t elapsedNs(const std::chrono::steady_clock::time_point& from,
+                                 const std::chrono::steady_clock::time_point& to) {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count();
+        }
+        
+        json11::Json toJson(int totalFrames, bool completed) const {
+            const double elapsed = elapsedNs(start, std::chrono::steady_clock::now()) / 1e9;
+            const int framesWritten = frames;
+            const double fps = framesWritten / std::max(1e-5, elapsed);
+            const double eta = fps > 0 ? (totalFrames - framesWritten) / fps : 0;
+            
+            // Stage timings are summed over all threads
+            json11::Json::object stages {
+                { "decodeMs", decodeNs / 1e6 },
+                { "bayerMs", bayerNs / 1e6 },
+                { "encodeMs", encodeNs / 1e6 },
+                { "writeMs", writeNs / 1e6 }
+            };
+            
+            return json11::Json::object {
+                { "completed", completed },
+                { "frames", framesWritten },
+                { "totalFrames", totalFrames },
+                { "elapsedSecs", elapsed },
+                { "etaSecs", completed ? 0.0 : eta },
+                { "fps", fps },
+                { "mbPerSec", (bytes / (1024.0*1024.0)) / std::max(1e-5, elapsed) },
+                { "stages", stages }
+            };
+        }
+        
+        std::chrono::steady_clock::time_point start;
+        
+        std::atomic<int64_t> decodeNs;
+        std::atomic<int64_t> bayerNs;
+        std::atomic<int64_t> encodeNs;
+        std::atomic<int64_t> writeNs;
+        std::atomic<int> frames;
+        std::atomic<int64_t> bytes;
+    };
+
     moodycamel::BlockingConcurrentQueue<std::shared_ptr<Job>> JOB_QUEUE;
     std::atomic<bool> RUNNING;
+    ConversionStats STATS;
+
+    static std::shared_ptr<Job> NextJob() {
+        std::shared_ptr<Job> job;
+
+        // Keep draining the queue after we've been told to stop so no frames are dropped
+        while(!JOB_QUEUE.wait_dequeue_timed(job, std::chrono::milliseconds(100))) {
+            if(!RUNNING) {
+                JOB_QUEUE.try_dequeue(job);
+                break;
+            }
+        }
+
+        return job;
+    }
 
-    static void WriteDNG(int fd) {
+    static void WriteDNG(int fd, const RawCameraMetadata& cameraMetadata, const cv::Rect cropArea, const cv::Size fullSize) {
         util::ZipWriter zipWriter(fd);
+        util::DngProfileCache profileCache(cameraMetadata);
         
-        while(RUNNING) {
-            std::shared_ptr<Job> job;
-            
-            JOB_QUEUE.wait_dequeue_timed(job, std::chrono::milliseconds(100));
+        profileCache.setCropArea(cropArea, fullSize);
+        
+        while(true) {
+            std::shared_ptr<Job> job = NextJob();
             if(!job)
-                continue;
+                break;
             
             try {
-                util::WriteDng(job->bayerImage, job->cameraMetadata, job->frameMetadata, zipWriter, job->filename);
+                auto encodeStart = std::chrono::steady_clock::now();
+                util::EncodedDng dng(job->bayerImage, job->cameraMetadata, job->frameMetadata, profileCache);
+
+                auto writeStart = std::chrono::steady_clock::now();
+                dng.write(zipWriter, job->filename);
+
+                auto writeEnd = std::chrono::steady_clock::now();
+
+                STATS.encodeNs += ConversionStats::elapsedNs(encodeStart, writeStart);
+                STATS.writeNs += ConversionStats::elapsedNs(writeStart, writeEnd);
+                STATS.bytes += dng.size();
+                STATS.frames++;
             }
             catch(std::runtime_error& e) {
                 job->error = e.what();
@@ -58,55 +152,125 @@ namespace motioncam {
         zipWriter.commit();
     }
 
-    float ConvertVideoToDNG(const std::string& containerPath, const DngProcessorProgress& progress, const int numThreads) {
-        if(RUNNING)
-            throw std::runtime_error("Already running");
-                        
-        RawContainer container(containerPath);
+    static void WriteDNGToDirectory(const std::string outputPath,
+                                    const RawCameraMetadata& cameraMetadata,
+                                    const cv::Rect cropArea,
+                                    const cv::Size fullSize)
+    {
+        util::DngProfileCache profileCache(cameraMetadata);
         
+        profileCache.setCropArea(cropArea, fullSize);
+
+        while(true) {
+            std::shared_ptr<Job> job = NextJob();
+            if(!job)
+                break;
+
+            // Each thread creates and writes its own files, there is no shared archive to serialise on
+            try {
+                auto encodeStart = std::chrono::steady_clock::now();
+                util::EncodedDng dng(job->bayerImage, job->cameraMetadata, job->frameMetadata, profileCache);
+
+                auto writeStart = std::chrono::steady_clock::now();
+                dng.write(outputPath + "/" + job->filename);
+
+                auto writeEnd = std::chrono::steady_clock::now();
+
+                STATS.encodeNs += ConversionStats::elapsedNs(encodeStart, writeStart);
+                STATS.writeNs += ConversionStats::elapsedNs(writeStart, writeEnd);
+                STATS.bytes += dng.size();
+                STATS.frames++;
+            }
+            catch(std::runtime_error& e) {
+                job->error = e.what();
+                logger::log("Failed to write " + job->filename + " (" + job->error + ")");
+            }
+        }
+    }
+
+    static std::vector<std::string> SelectFrames(const RawContainer& container, const DngExportOptions& options) {
         auto frames = container.getFrames();
         
         // Sort frames by timestamp
         std::sort(frames.begin(), frames.end(), [&](std::string& a, std::string& b) {
             return container.getFrame(a)->metadata.timestampNs < container.getFrame(b)->metadata.timestampNs;
         });
-                
-        int64_t timestampOffset = 0;
-        float timestamp = 0;
-
-        // Create processing threads
-        RUNNING = true;
         
-        std::vector<std::unique_ptr<std::thread>> threads;
-        std::vector<int> fds;
+        // Pick the requested range before anything is loaded
+        const int start = std::max(0, options.startFrame);
+        const int end = options.endFrame < 0 ? (int) frames.size() - 1 : std::min(options.endFrame, (int) frames.size() - 1);
+        const int stride = std::max(1, options.frameStride);
         
-        for(int i = 0; i < numThreads; i++) {
-            int fd = progress.onNeedFd(i);
-            if(fd < 0)
-                continue;
-            
-            auto t = std::unique_ptr<std::thread>(new std::thread(&WriteDNG, fd));
-            
-            threads.push_back(std::move(t));
-            
-            fds.push_back(fd);
-        }
+        std::vector<std::string> selectedFrames;
         
-        if(threads.empty())
-            return 0;
+        for(int i = start; i <= end; i += stride)
+            selectedFrames.push_back(frames[i]);
+        
+        return selectedFrames;
+    }
+    
+    static cv::Rect GetCropArea(const RawContainer& container,
+                                const std::vector<std::string>& frames,
+                                const DngExportOptions& options,
+                                cv::Size& outFullSize)
+    {
+        outFullSize = cv::Size();
+        
+        if(frames.empty())
+            return cv::Rect();
+        
+        auto frame = container.getFrame(frames[0]);
+        
+        outFullSize = cv::Size(frame->width, frame->height);
+        
+        if(options.cropWidth <= 0 || options.cropHeight <= 0)
+            return cv::Rect();
+        
+        // Keep the crop on even coordinates so the bayer pattern doesn't change
+        cv::Rect cropArea(options.cropX & ~1, options.cropY & ~1, options.cropWidth & ~1, options.cropHeight & ~1);
+        
+        cropArea &= cv::Rect(0, 0, frame->width & ~1, frame->height & ~1);
+        
+        if(cropArea.area() <= 0)
+            throw InvalidState("Crop area is outside of the frame");
+        
+        return cropArea;
+    }
+
+    static float ProcessFrames(RawContainer& container,
+                               const std::vector<std::string>& frames,
+                               const cv::Rect& cropArea,
+                               const DngProcessorProgress& progress,
+                               std::vector<std::unique_ptr<std::thread>>& threads)
+    {
+        int64_t timestampOffset = 0;
+        float timestamp = 0;
         
+        const auto statsInterval = std::chrono::seconds(1);
+        auto lastStats = std::chrono::steady_clock::now();
+
         for(int i = 0; i < frames.size(); i++) {
+            auto decodeStart = std::chrono::steady_clock::now();
             auto frame = container.loadFrame(frames[i]);
             
             if(frame->width <= 0 || frame->height <= 0) {
                 continue;
             }
             
+            // Only convert the area we are exporting
+            cv::Rect frameArea(0, 0, frame->width, frame->height);
+            
+            if(cropArea.area() > 0)
+                frameArea &= cropArea;
+            
             // Convert from RAW10/16 -> bayer image
+            auto bayerStart = std::chrono::steady_clock::now();
             auto* data = frame->data->lock(false);
 
             auto inputBuffer = Halide::Runtime::Buffer<uint8_t>(data, (int) frame->data->len());
-            auto bayerBuffer = Halide::Runtime::Buffer<uint16_t>(frame->width, frame->height);
+            auto bayerBuffer = Halide::Runtime::Buffer<uint16_t>(frameArea.width, frameArea.height);
+            
+            bayerBuffer.set_min(frameArea.x, frameArea.y);
             
             build_bayer(inputBuffer, frame->rowStride, static_cast<int>(frame->pixelFormat), bayerBuffer);
 
@@ -127,41 +291,454 @@ namespace motioncam {
             
             std::string dngFileName = "frame" + str.str() + ".dng";
 
-            while(!JOB_QUEUE.try_enqueue(std::make_shared<Job>(bayerImage, container.getCameraMetadata(), frame->metadata, dngFileName))) {
+            auto job = std::make_shared<Job>(bayerImage, container.getCameraMetadata(), frame->metadata, dngFileName);
+            auto bayerEnd = std::chrono::steady_clock::now();
+            
+            STATS.decodeNs += ConversionStats::elapsedNs(decodeStart, bayerStart);
+            STATS.bayerNs += ConversionStats::elapsedNs(bayerStart, bayerEnd);
+
+            while(!JOB_QUEUE.try_enqueue(job)) {
                 std::this_thread::sleep_for(std::chrono::milliseconds(100));
             }
             
-            // Finalise finished jobs
-            std::shared_ptr<Job> job;
-            
             // Wait until jobs are completed
-            while(JOB_QUEUE.size_approx() > numThreads) {
+            while(JOB_QUEUE.size_approx() > threads.size()) {
                 std::this_thread::sleep_for(std::chrono::milliseconds(100));
             }
             
             progress.onProgressUpdate((i*100)/frames.size());
+            
+            if(bayerEnd - lastStats >= statsInterval) {
+                progress.onStats(STATS.toJson(static_cast<int>(frames.size()), false).dump());
+                lastStats = bayerEnd;
+            }
         }
         
-        // Stop threads
+        // Stop the threads
         RUNNING = false;
         
-        // Stop the threads
         for(int i = 0; i < threads.size(); i++)
             threads[i]->join();
         
+        progress.onStats(STATS.toJson(static_cast<int>(frames.size()), true).dump());
+
+        return frames.size() / (1e-5f + timestamp);
+    }
+
+    float ConvertVideoToDNG(const std::string& containerPath,
+                            const DngProcessorProgress& progress,
+                            const int numThreads,
+                            const DngExportOptions& options)
+    {
+        if(RUNNING)
+            throw std::runtime_error("Already running");
+                        
+        RawContainer container(containerPath);
+        
+        auto frames = SelectFrames(container, options);
+        
+        cv::Size fullSize;
+        cv::Rect cropArea = GetCropArea(container, frames, options, fullSize);
+
+        // Create processing threads
+        RUNNING = true;
+        STATS.reset();
+        
+        std::vector<std::unique_ptr<std::thread>> threads;
+        std::vector<int> fds;
+        
+        for(int i = 0; i < numThreads; i++) {
+            int fd = progress.onNeedFd(i);
+            if(fd < 0)
+                continue;
+            
+            auto t = std::unique_ptr<std::thread>(
+                new std::thread(&WriteDNG, fd, std::cref(container.getCameraMetadata()), cropArea, fullSize));
+            
+            threads.push_back(std::move(t));
+            
+            fds.push_back(fd);
+        }
+        
+        if(threads.empty()) {
+            RUNNING = false;
+            return 0;
+        }
+        
+        float fps = ProcessFrames(container, frames, cropArea, progress, threads);
+        
         for(int i = 0; i < fds.size(); i++)
             progress.onCompleted(i);
+
+        progress.onCompleted();
+
+        return fps;
+    }
+
+    float ConvertVideoToDNG(const std::string& containerPath,
+                            const std::string& outputPath,
+                            const DngProcessorProgress& progress,
+                            const int numThreads,
+                            const DngExportOptions& options)
+    {
+        if(RUNNING)
+            throw std::runtime_error("Already running");
         
-//         Flush buffers
-//        std::shared_ptr<Job> job;
-//
-//        while(JOB_QUEUE.try_dequeue(job)) {
-//            util::WriteDng(job->bayerImage, job->cameraMetadata, job->frameMetadata, job->outputFd);
-//        }
+        struct stat outputStat;
+        
+        if(stat(outputPath.c_str(), &outputStat) != 0 || !S_ISDIR(outputStat.st_mode))
+            throw IOException("Output path " + outputPath + " is not a directory");
+
+        RawContainer container(containerPath);
+        
+        auto frames = SelectFrames(container, options);
+        
+        cv::Size fullSize;
+        cv::Rect cropArea = GetCropArea(container, frames, options, fullSize);
+
+        // Create processing threads
+        RUNNING = true;
+        STATS.reset();
+        
+        std::vector<std::unique_ptr<std::thread>> threads;
+        
+        for(int i = 0; i < std::max(1, numThreads); i++) {
+            auto t = std::unique_ptr<std::thread>(
+                new std::thread(&WriteDNGToDirectory, outputPath, std::cref(container.getCameraMetadata()), cropArea, fullSize));
+            
+            threads.push_back(std::move(t));
+        }
+        
+        float fps = ProcessFrames(container, frames, cropArea, progress, threads);
 
         progress.onCompleted();
 
-        return frames.size() / (1e-5f + timestamp);
+        return fps;
+    }
+
+    // Releases the decoded data of a frame when it goes out of scope
+    struct FrameDataReleaser {
+        FrameDataReleaser(const std::shared_ptr<RawImageBuffer>& frame) : frame(frame)
+        {
+        }
+        
+        ~FrameDataReleaser() {
+            frame->data->release();
+        }
+        
+        std::shared_ptr<RawImageBuffer> frame;
+    };
+
+    struct ProxyJob {
+        ProxyJob(int index, std::shared_ptr<RawImageBuffer> frame) : index(index), frame(frame)
+        {
+        }
+        
+        const int index;
+        std::shared_ptr<RawImageBuffer> frame;
+    };
+
+    struct ProxyContext {
+        ProxyContext(const RawCameraMetadata& cameraMetadata,
+                     const PostProcessSettings& settings,
+                     const std::string& outputPath,
+                     const ProxyFormat format,
+                     const int downscaleFactor,
+                     const bool fastPreview,
+                     const cv::Size frameSize) :
+        cameraMetadata(cameraMetadata),
+        settings(settings),
+        outputPath(outputPath),
+        format(format),
+        downscaleFactor(downscaleFactor),
+        fastPreview(fastPreview),
+        frameSize(frameSize),
+        stream(nullptr),
+        nextFrame(0)
+        {
+        }
+        
+        const RawCameraMetadata& cameraMetadata;
+        const PostProcessSettings settings;
+        const std::string outputPath;
+        const ProxyFormat format;
+        const int downscaleFactor;
+        const bool fastPreview;
+        const cv::Size frameSize;
+        
+        moodycamel::BlockingConcurrentQueue<std::shared_ptr<ProxyJob>> jobs;
+        
+        // Frames are rendered out of order but the Y4M stream must be written in order
+        FILE* stream;
+        std::mutex streamLock;
+        std::map<int, std::vector<uint8_t>> pendingFrames;
+        int nextFrame;
+    };
+
+    static void WriteY4MFrame(ProxyContext* context, const int index, std::vector<uint8_t>& data) {
+        std::lock_guard<std::mutex> lock(context->streamLock);
+        
+        context->pendingFrames[index].swap(data);
+        
+        auto it = context->pendingFrames.find(context->nextFrame);
+        
+        while(it != context->pendingFrames.end()) {
+            const std::vector<uint8_t>& frameData = it->second;
+            
+            // Frames that failed to render are dropped
+            if(!frameData.empty() &&
+               (fputs("FRAME\n", context->stream) < 0 ||
+                fwrite(frameData.data(), 1, frameData.size(), context->stream) != frameData.size()))
+            {
+                logger::log("Failed to write proxy frame " + std::to_string(context->nextFrame));
+            }
+
+            STATS.bytes += frameData.size();
+            
+            context->pendingFrames.erase(it);
+            context->nextFrame++;
+            
+            it = context->pendingFrames.find(context->nextFrame);
+        }
+    }
+
+    static void RenderProxy(ProxyContext* context) {
+        while(true) {
+            std::shared_ptr<ProxyJob> job;
+            
+            if(!context->jobs.wait_dequeue_timed(job, std::chrono::milliseconds(100))) {
+                if(RUNNING)
+                    continue;
+                
+                if(!context->jobs.try_dequeue(job))
+                    break;
+            }
+            
+            try {
+                auto renderStart = std::chrono::steady_clock::now();
+                Halide::Runtime::Buffer<uint8_t> previewBuffer;
+                
+                // The frame is only needed to render the preview, release it even if that fails
+                {
+                    FrameDataReleaser releaser(job->frame);
+                    
+                    previewBuffer =
+                        ImageProcessor::createPreview(*job->frame, context->downscaleFactor, context->cameraMetadata, context->settings, context->fastPreview);
+                }
+                
+                cv::Mat preview(previewBuffer.height(), previewBuffer.width(), CV_8UC4, previewBuffer.data());
+                
+                // Every frame of a stream must have the same size
+                if(preview.cols < context->frameSize.width || preview.rows < context->frameSize.height)
+                    cv::resize(preview, preview, context->frameSize, 0, 0, cv::INTER_AREA);
+                
+                preview = preview(cv::Rect(0, 0, context->frameSize.width, context->frameSize.height));
+
+                if(context->format == ProxyFormat::Y4M) {
+                    cv::Mat rgb, yuv;
+                    
+                    cv::cvtColor(preview, rgb, cv::COLOR_RGBA2RGB);
+                    cv::cvtColor(rgb, yuv, cv::COLOR_RGB2YUV_I420);
+                    
+                    std::vector<uint8_t> frameData(yuv.datastart, yuv.dataend);
+                    
+                    auto writeStart = std::chrono::steady_clock::now();
+                    
+                    WriteY4MFrame(context, job->index, frameData);
+
+                    STATS.encodeNs += ConversionStats::elapsedNs(renderStart, writeStart);
+                    STATS.writeNs += ConversionStats::elapsedNs(writeStart, std::chrono::steady_clock::now());
+                }
+                else {
+                    cv::Mat bgr;
+                    std::vector<uint8_t> jpegData;
+
+                    cv::cvtColor(preview, bgr, cv::COLOR_RGBA2BGR);
+                    cv::imencode(".jpg", bgr, jpegData, { cv::IMWRITE_JPEG_QUALITY, context->settings.jpegQuality });
+
+                    std::ostringstream str;
+                    
+                    str << std::setw(4) << std::setfill('0') << job->index;
+
+                    auto writeStart = std::chrono::steady_clock::now();
+                    
+                    util::WriteFile(jpegData.data(), jpegData.size(), context->outputPath + "/frame" + str.str() + ".jpg");
+
+                    STATS.encodeNs += ConversionStats::elapsedNs(renderStart, writeStart);
+                    STATS.writeNs += ConversionStats::elapsedNs(writeStart, std::chrono::steady_clock::now());
+                    STATS.bytes += jpegData.size();
+                }
+                
+                STATS.frames++;
+            }
+            catch(std::exception& e) {
+                logger::log("Failed to write proxy frame " + std::to_string(job->index) + " (" + e.what() + ")");
+
+                // Don't hold up the frames that follow
+                if(context->format == ProxyFormat::Y4M) {
+                    std::vector<uint8_t> empty;
+                    WriteY4MFrame(context, job->index, empty);
+                }
+            }
+        }
+    }
+
+    float ConvertVideoToProxy(const std::string& containerPath,
+                              const std::string& outputPath,
+                              const DngProcessorProgress& progress,
+                              const ProxyFormat format,
+                              const int downscaleFactor,
+                              const int numThreads,
+                              const DngExportOptions& options,
+                              const bool fastPreview)
+    {
+        if(RUNNING)
+            throw std::runtime_error("Already running");
+        
+        if(downscaleFactor != 1 && downscaleFactor != 2 && downscaleFactor != 4 && downscaleFactor != 8)
+            throw InvalidState("Invalid downscale factor");
+
+        if(format == ProxyFormat::JPEG_SEQUENCE) {
+            struct stat outputStat;
+            
+            if(stat(outputPath.c_str(), &outputStat) != 0 || !S_ISDIR(outputStat.st_mode))
+                throw IOException("Output path " + outputPath + " is not a directory");
+        }
+
+        RawContainer container(containerPath);
+        
+        auto frames = SelectFrames(container, options);
+        if(frames.empty()) {
+            progress.onCompleted();
+            return 0;
+        }
+        
+        // Size the output from the first frame, matching the preview pipeline
+        auto firstFrame = container.getFrame(frames[0]);
+        auto lastFrame = container.getFrame(frames[frames.size() - 1]);
+        
+        int width = firstFrame->width / 2 / downscaleFactor;
+        int height = firstFrame->height / 2 / downscaleFactor;
+        
+        if(firstFrame->metadata.screenOrientation == ScreenOrientation::PORTRAIT ||
+           firstFrame->metadata.screenOrientation == ScreenOrientation::REVERSE_PORTRAIT)
+        {
+            std::swap(width, height);
+        }
+        
+        // 4:2:0 chroma needs even dimensions
+        cv::Size frameSize(width & ~1, height & ~1);
+        
+        const int64_t durationNs = lastFrame->metadata.timestampNs - firstFrame->metadata.timestampNs;
+        const float fps = frames.size() > 1 && durationNs > 0 ? (frames.size() - 1) * 1e9f / durationNs : 30.0f;
+        
+        ProxyContext context(
+            container.getCameraMetadata(), container.getPostProcessSettings(), outputPath, format, downscaleFactor, fastPreview, frameSize);
+        
+        if(format == ProxyFormat::Y4M) {
+            context.stream = fopen(outputPath.c_str(), "wb");
+            if(!context.stream)
+                throw IOException("Failed to open " + outputPath);
+            
+            fprintf(context.stream,
+                    "YUV4MPEG2 W%d H%d F%d:1000 Ip A1:1 C420jpeg\n",
+                    frameSize.width,
+                    frameSize.height,
+                    static_cast<int>(std::round(fps * 1000)));
+        }
+
+        // Create processing threads
+        RUNNING = true;
+        STATS.reset();
+        
+        std::vector<std::unique_ptr<std::thread>> threads;
+        
+        for(int i = 0; i < std::max(1, numThreads); i++) {
+            auto t = std::unique_ptr<std::thread>(new std::thread(&RenderProxy, &context));
+            
+            threads.push_back(std::move(t));
+        }
+        
+        // Decode on this thread while the workers render previous frames
+        const auto statsInterval = std::chrono::seconds(1);
+        auto lastStats = std::chrono::steady_clock::now();
+        int index = 0;
+        
+        for(int i = 0; i < frames.size(); i++) {
+            auto decodeStart = std::chrono::steady_clock::now();
+            auto frame = container.loadFrame(frames[i]);
+            
+            if(frame->width <= 0 || frame->height <= 0) {
+                continue;
+            }
+            
+            auto decodeEnd = std::chrono::steady_clock::now();
+
+            STATS.decodeNs += ConversionStats::elapsedNs(decodeStart, decodeEnd);
+
+            context.jobs.enqueue(std::make_shared<ProxyJob>(index++, frame));
+            
+            // Bound the number of decoded frames held in memory
+            while(context.jobs.size_approx() > threads.size()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            
+            progress.onProgressUpdate((i*100)/frames.size());
+            
+            if(decodeEnd - lastStats >= statsInterval) {
+                progress.onStats(STATS.toJson(static_cast<int>(frames.size()), false).dump());
+                lastStats = decodeEnd;
+            }
+        }
+        
+        // Stop the threads
+        RUNNING = false;
+        
+        for(int i = 0; i < threads.size(); i++)
+            threads[i]->join();
+        
+        if(context.stream)
+            fclose(context.stream);
+
+        progress.onStats(STATS.toJson(static_cast<int>(frames.size()), true).dump());
+        progress.onCompleted();
+
+        return fps;
+    }
+
+    void EstimateVideoSettings(const std::string& containerPath, std::ostream& output, const DngExportOptions& options) {
+        RawContainer container(containerPath);
+        SettingsEstimator estimator;
+        
+        auto frames = SelectFrames(container, options);
+        
+        for(int i = 0; i < frames.size(); i++) {
+            auto frame = container.loadFrame(frames[i]);
+            
+            if(frame->width <= 0 || frame->height <= 0) {
+                frame->data->release();
+                continue;
+            }
+            
+            estimator.add(*frame, container.getCameraMetadata());
+            
+            // Only the metadata is needed after this
+            frame->data->release();
+            
+            PostProcessSettings settings;
+            
+            if(!estimator.estimate(settings))
+                continue;
+            
+            json11::Json::object settingsJson;
+            
+            settings.toJson(settingsJson);
+            
+            settingsJson["frame"] = i;
+            settingsJson["timestampNs"] = std::to_string(frame->metadata.timestampNs);
+            
+            output << json11::Json(settingsJson).dump() << std::endl;
+        }
     }
 
     void ProcessImage(const std::string& containerPath, const std::string& outputFilePath, const ImageProcessorProgress& progressListener) {
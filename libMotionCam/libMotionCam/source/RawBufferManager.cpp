@@ -256,6 +256,12 @@ namespace motioncam {
                 }
             }
 
+            // Use the latest frame when the reference is gone
+            if(buffers.empty()) {
+                buffers.push_back(mReadyBuffers[referenceIdx]);
+                --numSaveBuffers;
+            }
+
             // Update timestamp
             referenceTimestampNs = mReadyBuffers[referenceIdx]->metadata.timestampNs;
 
@@ -0,0 +1,47 @@
+#include "motioncam/Resources.h"
+
+#include <vector>
+#include <mutex>
+
+#include "motioncam/BlueNoiseLUT.h"
+#include "motioncam/FaceClassifier.h"
+
+namespace motioncam {
+    namespace resources {
+        static std::mutex FACE_CLASSIFIER_LOCK;
+    
+        static cv::FileStorage& FaceClassifierStorage() {
+            static cv::FileStorage fs(
+                cv::String(&lbpcascade_frontalface_improved_xml[0]), cv::FileStorage::READ | cv::FileStorage::MEMORY);
+            
+            return fs;
+        }
+    
+        const cv::Mat& BlueNoise() {
+            static const cv::Mat noise = cv::imdecode(BLUE_NOISE_PNG, cv::IMREAD_UNCHANGED);
+            
+            return noise;
+        }
+    
+        cv::CascadeClassifier& FaceClassifier() {
+            thread_local cv::CascadeClassifier classifier;
+            
+            if(classifier.empty()) {
+                // The XML is only parsed once, reading from the shared storage is serialised
+                std::lock_guard<std::mutex> lock(FACE_CLASSIFIER_LOCK);
+                
+                classifier.read(FaceClassifierStorage().getFirstTopLevelNode());
+            }
+            
+            return classifier;
+        }
+    
+        void Prewarm() {
+            BlueNoise();
+            
+            std::lock_guard<std::mutex> lock(FACE_CLASSIFIER_LOCK);
+            
+            FaceClassifierStorage();
+        }
+    }
+}
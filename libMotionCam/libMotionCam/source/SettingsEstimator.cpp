@@ -0,0 +1,186 @@
+#include "motioncam/SettingsEstimator.h"
+#include "motioncam/RawImageMetadata.h"
+#include "motioncam/ImageProcessor.h"
+#include "motioncam/CameraProfile.h"
+#include "motioncam/Temperature.h"
+#include "motioncam/Settings.h"
+
+namespace motioncam {
+    // Raw channel for red, green, green and blue in each sensor arrangement. Matches rearrange() in the generators.
+    static const int CHANNEL_ORDER[4][4] = {
+        { 0, 1, 2, 3 },     // RGGB
+        { 1, 0, 3, 2 },     // GRBG
+        { 2, 0, 3, 1 },     // GBRG
+        { 3, 1, 2, 0 }      // BGGR
+    };
+
+    static inline int readPixel(const uint8_t* row, const int x, const PixelFormat format) {
+        if(format == PixelFormat::RAW10) {
+            const uint8_t* p = row + (x >> 2) * 5;
+            const int i = x & 3;
+
+            return (p[i] << 2) | ((p[4] >> (i * 2)) & 0x03);
+        }
+
+        return row[x * 2] | (row[x * 2 + 1] << 8);
+    }
+
+    static inline float shadingAt(const cv::Mat& shadingMap, const int x, const int y, const int width, const int height) {
+        if(shadingMap.empty())
+            return 1.0f;
+
+        const int mx = std::min(shadingMap.cols - 1, x * shadingMap.cols / width);
+        const int my = std::min(shadingMap.rows - 1, y * shadingMap.rows / height);
+
+        return shadingMap.at<float>(my, mx);
+    }
+
+    SettingsEstimator::SettingsEstimator(const int rowsPerFrame, const int columnStep, const float smoothing) :
+        mRowsPerFrame(std::max(1, rowsPerFrame)),
+        mColumnStep(std::max(1, columnStep)),
+        mSmoothing(smoothing),
+        mRowOffset(0),
+        mKeyValue(0),
+        mTemperature(0),
+        mTint(0)
+    {
+    }
+
+    void SettingsEstimator::reset() {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        mRowOffset = 0;
+        mHistogram.release();
+    }
+
+    void SettingsEstimator::add(const RawImageBuffer& buffer, const RawCameraMetadata& cameraMetadata) {
+        // Same formats as the Halide pipelines
+        if(buffer.pixelFormat != PixelFormat::RAW10 && buffer.pixelFormat != PixelFormat::RAW16)
+            return;
+
+        if(cameraMetadata.sensorArrangment == ColorFilterArrangment::RGB ||
+           cameraMetadata.sensorArrangment == ColorFilterArrangment::MONO)
+        {
+            return;
+        }
+
+        const int halfWidth  = buffer.width / 2;
+        const int halfHeight = buffer.height / 2;
+
+        if(halfWidth <= 0 || halfHeight <= 0)
+            return;
+
+        // White balance and colour matrix of this frame
+        CameraProfile cameraProfile(cameraMetadata, buffer.metadata);
+        Temperature temperature;
+
+        cameraProfile.temperatureFromVector(buffer.metadata.asShot, temperature);
+
+        cv::Mat cameraToPcs;
+        cv::Mat pcsToSrgb;
+        cv::Vec3f cameraWhite;
+
+        ImageProcessor::createSrgbMatrix(cameraMetadata, buffer.metadata, buffer.metadata.asShot, cameraWhite, cameraToPcs, pcsToSrgb);
+
+        cv::Mat cameraToSrgb = pcsToSrgb * cameraToPcs;
+        cameraToSrgb.convertTo(cameraToSrgb, CV_32F);
+
+        const cv::Matx33f m(cameraToSrgb.ptr<float>());
+        const int* order = CHANNEL_ORDER[static_cast<int>(cameraMetadata.sensorArrangment)];
+
+        float scale[4];
+        for(int c = 0; c < 4; c++)
+            scale[c] = 1.0f / (cameraMetadata.whiteLevel - cameraMetadata.blackLevel[c]);
+
+        // Luminance histogram of the sampled rows, computed the same way as measure_image
+        cv::Mat histogram = cv::Mat::zeros(1, 256, CV_32F);
+
+        const int rowStep = std::max(1, halfHeight / mRowsPerFrame);
+        int rowOffset;
+
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            rowOffset = mRowOffset;
+        }
+
+        const uint8_t* data = buffer.data->lock(false);
+
+        if(!data)
+            return;
+
+        int samples = 0;
+
+        for(int y = rowOffset % rowStep; y < halfHeight; y += rowStep) {
+            const uint8_t* rows[2] = {
+                data + (2 * y) * buffer.rowStride,
+                data + (2 * y + 1) * buffer.rowStride
+            };
+
+            for(int x = 0; x < halfWidth; x += mColumnStep) {
+                float v[4];
+
+                for(int c = 0; c < 4; c++) {
+                    const int channel = order[c];
+                    const int p = readPixel(rows[channel >> 1], 2 * x + (channel & 1), buffer.pixelFormat);
+
+                    v[c] = (p - cameraMetadata.blackLevel[c]) * scale[c]
+                            * shadingAt(buffer.metadata.lensShadingMap[c], x, y, halfWidth, halfHeight);
+                }
+
+                const cv::Vec3f rgb(
+                    std::max(0.0f, std::min(v[0], cameraWhite[0])),
+                    std::max(0.0f, std::min((v[1] + v[2]) / 2, cameraWhite[1])),
+                    std::max(0.0f, std::min(v[3], cameraWhite[2])));
+
+                const cv::Vec3f srgb = m * rgb;
+                const float L = 0.2989f*srgb[0] + 0.5870f*srgb[1] + 0.1140f*srgb[2];
+
+                const int bin = std::max(0, std::min(255, static_cast<int>(L * 255 + 0.5f)));
+
+                histogram.at<float>(bin) += 1.0f;
+                ++samples;
+            }
+        }
+
+        buffer.data->unlock();
+
+        if(samples == 0)
+            return;
+
+        histogram /= samples;
+
+        const float keyValue = ImageProcessor::getShadowKeyValue(buffer, cameraMetadata, false);
+
+        // Blend into the running estimate
+        std::lock_guard<std::mutex> lock(mLock);
+
+        mTemperature = static_cast<float>(temperature.temperature());
+        mTint        = static_cast<float>(temperature.tint());
+
+        if(mHistogram.empty()) {
+            mHistogram = histogram;
+            mKeyValue = keyValue;
+        }
+        else {
+            mHistogram = (1.0f - mSmoothing) * mHistogram + mSmoothing * histogram;
+            mKeyValue = (1.0f - mSmoothing) * mKeyValue + mSmoothing * keyValue;
+        }
+
+        mRowOffset = (mRowOffset + 1) % rowStep;
+    }
+
+    bool SettingsEstimator::estimate(PostProcessSettings& outSettings) const {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        if(mHistogram.empty())
+            return false;
+
+        outSettings.temperature    = mTemperature;
+        outSettings.tint           = mTint;
+        outSettings.shadows        = ImageProcessor::estimateShadows(mHistogram, mKeyValue);
+        outSettings.exposure       = ImageProcessor::estimateExposureCompensation(mHistogram, 1e-3f);
+        outSettings.hdr            = ImageProcessor::estimateHdr(mHistogram);
+
+        return true;
+    }
+}
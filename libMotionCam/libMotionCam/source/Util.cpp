@@ -3,8 +3,11 @@
 #include "motioncam/RawImageMetadata.h"
 
 #include <fstream>
+#include <cstring>
+#include <atomic>
 #include <unistd.h>
 #include <zstd.h>
+#include <miniz.h>
 
 #include <dng/dng_host.h>
 #include <dng/dng_negative.h>
@@ -14,6 +17,7 @@
 #include <dng/dng_image_writer.h>
 #include <dng/dng_render.h>
 #include <dng/dng_gain_map.h>
+#include <dng/dng_opcode_list.h>
 
 using std::string;
 using std::vector;
@@ -68,6 +72,18 @@ namespace motioncam {
                 throw IOException("Can't add " + filename);
             }
         }
+
+        void ZipWriter::addFile(const std::string& filename, mz_file_read_func readFunc, void* opaque, const size_t numBytes) {
+            if(mCommited) {
+                throw IOException("Can't add " + filename + " because archive has been commited");
+            }
+            
+            if(!mz_zip_writer_add_read_buf_callback(
+                &mZip, filename.c_str(), readFunc, opaque, numBytes, nullptr, nullptr, 0, MZ_NO_COMPRESSION, nullptr, 0, nullptr, 0))
+            {
+                throw IOException("Can't add " + filename);
+            }
+        }
     
         void ZipWriter::commit() {
             if(!mz_zip_writer_finalize_archive(&mZip)) {
@@ -149,6 +165,542 @@ namespace motioncam {
             return mFiles;
         }
     
+        //
+        // JPEG strip writer
+        //
+    
+        // Rows per restart interval, reduced for very wide images so the interval fits in 16 bits
+        static const int JPEG_STRIP_HEIGHT = 256;
+    
+        struct JpegLayout {
+            size_t headerEnd;
+            size_t sofOffset;
+            size_t sosOffset;
+            size_t dataOffset;
+            size_t dataEnd;
+            int mcuWidth;
+            int mcuHeight;
+        };
+    
+        static void ParseJpeg(const vector<uint8_t>& data, JpegLayout& outLayout) {
+            if(data.size() < 4 || data[0] != 0xFF || data[1] != 0xD8)
+                throw IOException("Invalid JPEG data");
+            
+            outLayout = JpegLayout { 2, 0, 0, 0, 0, 8, 8 };
+            
+            size_t pos = 2;
+            
+            // Application segments go after the JFIF header
+            if(data.size() > 6 && data[2] == 0xFF && data[3] == 0xE0)
+                outLayout.headerEnd = 4 + ((data[4] << 8) | data[5]);
+            
+            while(pos + 4 <= data.size()) {
+                if(data[pos] != 0xFF)
+                    throw IOException("Invalid JPEG marker");
+                
+                const uint8_t marker = data[pos + 1];
+                const size_t length = (data[pos + 2] << 8) | data[pos + 3];
+                
+                if(marker == 0xC0) {
+                    outLayout.sofOffset = pos;
+                    
+                    // Size of the MCU comes from the largest sampling factors
+                    const int numComponents = data[pos + 9];
+                    
+                    for(int i = 0; i < numComponents; i++) {
+                        const uint8_t sampling = data[pos + 11 + i*3];
+                        
+                        outLayout.mcuWidth = std::max(outLayout.mcuWidth, 8 * (sampling >> 4));
+                        outLayout.mcuHeight = std::max(outLayout.mcuHeight, 8 * (sampling & 0x0F));
+                    }
+                }
+                else if((marker >= 0xC1 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) || marker == 0xDD) {
+                    throw IOException("Only baseline JPEG strips without restart markers are supported");
+                }
+                else if(marker == 0xDA) {
+                    outLayout.sosOffset = pos;
+                    outLayout.dataOffset = pos + 2 + length;
+                    break;
+                }
+                
+                pos += 2 + length;
+            }
+            
+            if(outLayout.sofOffset == 0 || outLayout.sosOffset == 0)
+                throw IOException("Invalid JPEG data");
+            
+            // Entropy coded data runs up to the end of image marker
+            if(data[data.size() - 2] != 0xFF || data[data.size() - 1] != 0xD9)
+                throw IOException("Invalid JPEG data");
+            
+            outLayout.dataEnd = data.size() - 2;
+        }
+    
+        JpegStripWriter::JpegStripWriter(const std::string& outputPath, const int width, const int height, const int quality) :
+            mFile(nullptr),
+            mWidth(width),
+            mHeight(height),
+            mQuality(quality),
+            mStripHeight(JPEG_STRIP_HEIGHT),
+            mPendingRows(0),
+            mRowsEncoded(0),
+            mStripsWritten(0),
+            mCommited(false)
+        {
+            if(width <= 0 || height <= 0 || width > 65535 || height > 65535)
+                throw InvalidState("Invalid JPEG size");
+            
+            // Assume 16x16 MCUs, checked against the encoder output
+            const int mcusPerRow = (width + 15) / 16;
+            
+            while(mStripHeight > 16 && mcusPerRow * (mStripHeight / 16) > 65535)
+                mStripHeight /= 2;
+            
+            mFile = fopen(outputPath.c_str(), "wb");
+            if(!mFile)
+                throw IOException("Cannot write to " + outputPath);
+        }
+    
+        JpegStripWriter::~JpegStripWriter() {
+            if(mFile)
+                fclose(mFile);
+        }
+    
+        void JpegStripWriter::setExif(const std::vector<uint8_t>& exifData) {
+            if(mStripsWritten > 0)
+                throw InvalidState("Can't set EXIF data after rows have been written");
+            
+            // APP1 length includes the length field and the identifier
+            if(exifData.size() + 8 > 65535)
+                throw InvalidState("EXIF data is too large");
+            
+            mExifData = exifData;
+        }
+    
+        void JpegStripWriter::write(const cv::Mat& rows) {
+            if(mCommited)
+                throw IOException("Can't write rows because image has been commited");
+            
+            if(rows.cols != mWidth || rows.type() != CV_8UC3)
+                throw InvalidState("Invalid JPEG rows");
+            
+            if(mRowsEncoded + mPendingRows + rows.rows > mHeight)
+                throw InvalidState("Too many JPEG rows");
+            
+            std::vector<cv::Mat> strips;
+            int row = 0;
+            
+            while(row < rows.rows) {
+                // Encode directly from the input when there is nothing buffered
+                if(mPendingRows == 0 && rows.rows - row >= mStripHeight) {
+                    strips.push_back(rows.rowRange(row, row + mStripHeight));
+                    row += mStripHeight;
+                    continue;
+                }
+                
+                if(mPending.empty())
+                    mPending.create(mStripHeight, mWidth, CV_8UC3);
+                
+                const int n = std::min(mStripHeight - mPendingRows, rows.rows - row);
+                
+                rows.rowRange(row, row + n).copyTo(mPending.rowRange(mPendingRows, mPendingRows + n));
+                
+                mPendingRows += n;
+                row += n;
+                
+                if(mPendingRows == mStripHeight) {
+                    strips.push_back(mPending);
+                    
+                    mPending = cv::Mat();
+                    mPendingRows = 0;
+                }
+            }
+            
+            encodeStrips(strips);
+        }
+    
+        void JpegStripWriter::commit() {
+            if(mCommited)
+                return;
+            
+            if(mPendingRows > 0) {
+                encodeStrips({ mPending.rowRange(0, mPendingRows) });
+                mPendingRows = 0;
+            }
+            
+            if(mRowsEncoded != mHeight)
+                throw InvalidState("Incomplete JPEG image");
+            
+            const uint8_t eoi[] = { 0xFF, 0xD9 };
+            
+            if(fwrite(eoi, 1, sizeof(eoi), mFile) != sizeof(eoi) || fclose(mFile) != 0) {
+                mFile = nullptr;
+                throw IOException("Failed to write JPEG");
+            }
+            
+            mFile = nullptr;
+            mCommited = true;
+        }
+    
+        void JpegStripWriter::encodeStrips(const std::vector<cv::Mat>& strips) {
+            if(strips.empty())
+                return;
+            
+            const std::vector<int> params = {
+                cv::IMWRITE_JPEG_QUALITY, mQuality,
+                cv::IMWRITE_JPEG_OPTIMIZE, 0,
+                cv::IMWRITE_JPEG_PROGRESSIVE, 0,
+                cv::IMWRITE_JPEG_RST_INTERVAL, 0
+            };
+            
+            std::vector<std::vector<uint8_t>> encodedStrips(strips.size());
+            std::atomic<bool> failed(false);
+            
+            // Strips don't depend on each other so they can be encoded at the same time
+            cv::parallel_for_(cv::Range(0, static_cast<int>(strips.size())), [&](const cv::Range& range) {
+                for(int i = range.start; i < range.end; i++) {
+                    try {
+                        if(!cv::imencode(".jpg", strips[i], encodedStrips[i], params))
+                            failed = true;
+                    }
+                    catch(cv::Exception& e) {
+                        failed = true;
+                    }
+                }
+            });
+            
+            if(failed)
+                throw IOException("Failed to encode JPEG strip");
+            
+            for(size_t i = 0; i < strips.size(); i++) {
+                appendStrip(encodedStrips[i]);
+                
+                mRowsEncoded += strips[i].rows;
+            }
+        }
+    
+        void JpegStripWriter::appendStrip(const std::vector<uint8_t>& encodedStrip) {
+            JpegLayout layout;
+            
+            ParseJpeg(encodedStrip, layout);
+            
+            if(mStripsWritten == 0) {
+                // Every strip but the last has to end on an MCU boundary
+                if(mStripHeight % layout.mcuHeight != 0)
+                    throw InvalidState("JPEG strip height is not a multiple of the MCU height");
+                
+                const int mcusPerRow = (mWidth + layout.mcuWidth - 1) / layout.mcuWidth;
+                const int restartInterval = mcusPerRow * (mStripHeight / layout.mcuHeight);
+                
+                if(restartInterval > 65535)
+                    throw InvalidState("JPEG restart interval is too large");
+                
+                // Headers come from the first strip with the height set to the full image
+                std::vector<uint8_t> header(encodedStrip.begin(), encodedStrip.begin() + layout.sosOffset);
+                
+                header[layout.sofOffset + 5] = (mHeight >> 8) & 0xFF;
+                header[layout.sofOffset + 6] = mHeight & 0xFF;
+                
+                if(!mExifData.empty()) {
+                    const size_t length = mExifData.size() + 8;
+                    const uint8_t app1[] = {
+                        0xFF, 0xE1,
+                        static_cast<uint8_t>((length >> 8) & 0xFF),
+                        static_cast<uint8_t>(length & 0xFF),
+                        'E', 'x', 'i', 'f', 0x00, 0x00
+                    };
+                    
+                    std::vector<uint8_t> segment(app1, app1 + sizeof(app1));
+                    
+                    segment.insert(segment.end(), mExifData.begin(), mExifData.end());
+                    header.insert(header.begin() + layout.headerEnd, segment.begin(), segment.end());
+                }
+                
+                const uint8_t dri[] = {
+                    0xFF, 0xDD, 0x00, 0x04,
+                    static_cast<uint8_t>((restartInterval >> 8) & 0xFF),
+                    static_cast<uint8_t>(restartInterval & 0xFF)
+                };
+                
+                header.insert(header.end(), dri, dri + sizeof(dri));
+                header.insert(header.end(), encodedStrip.begin() + layout.sosOffset, encodedStrip.begin() + layout.dataOffset);
+                
+                if(fwrite(header.data(), 1, header.size(), mFile) != header.size())
+                    throw IOException("Failed to write JPEG");
+            }
+            else {
+                const uint8_t rst[] = { 0xFF, static_cast<uint8_t>(0xD0 + ((mStripsWritten - 1) % 8)) };
+                
+                if(fwrite(rst, 1, sizeof(rst), mFile) != sizeof(rst))
+                    throw IOException("Failed to write JPEG");
+            }
+            
+            const size_t dataSize = layout.dataEnd - layout.dataOffset;
+            
+            if(fwrite(encodedStrip.data() + layout.dataOffset, 1, dataSize, mFile) != dataSize)
+                throw IOException("Failed to write JPEG");
+            
+            ++mStripsWritten;
+        }
+    
+        //
+        // TIFF strip writer
+        //
+    
+        static const int TIFF_STRIP_HEIGHT = 64;
+    
+        static void PutTiff16(vector<uint8_t>& data, const uint16_t value) {
+            data.push_back(value & 0xFF);
+            data.push_back((value >> 8) & 0xFF);
+        }
+    
+        static void PutTiff32(vector<uint8_t>& data, const uint32_t value) {
+            PutTiff16(data, value & 0xFFFF);
+            PutTiff16(data, (value >> 16) & 0xFFFF);
+        }
+    
+        static void PutTiffEntry(vector<uint8_t>& data, const uint16_t tag, const uint16_t type, const uint32_t count, const uint32_t value) {
+            PutTiff16(data, tag);
+            PutTiff16(data, type);
+            PutTiff32(data, count);
+            
+            // Short values are left aligned in the value field
+            if(type == 3 && count == 1) {
+                PutTiff16(data, value);
+                PutTiff16(data, 0);
+            }
+            else {
+                PutTiff32(data, value);
+            }
+        }
+    
+        static void EncodeTiffStrip(const cv::Mat& strip, const TiffCompression compression, vector<uint8_t>& output) {
+            cv::Mat rgb;
+            cv::cvtColor(strip, rgb, cv::COLOR_BGR2RGB);
+            
+            // Horizontal differencing (predictor 2) makes the data much more compressible
+            for(int y = 0; y < rgb.rows; y++) {
+                uint16_t* row = rgb.ptr<uint16_t>(y);
+                
+                for(int x = rgb.cols*3 - 1; x >= 3; x--)
+                    row[x] -= row[x - 3];
+            }
+            
+            const size_t size = rgb.total() * rgb.elemSize();
+            
+            if(compression == TiffCompression::ZSTD) {
+                output.resize(ZSTD_compressBound(size));
+                
+                size_t outputSize = ZSTD_compress(output.data(), output.size(), rgb.data, size, 1);
+                if(ZSTD_isError(outputSize))
+                    throw IOException("Failed to compress TIFF strip");
+                
+                output.resize(outputSize);
+            }
+            else {
+                mz_ulong outputSize = mz_compressBound(size);
+                output.resize(outputSize);
+                
+                if(mz_compress2(output.data(), &outputSize, rgb.data, size, 1) != MZ_OK)
+                    throw IOException("Failed to compress TIFF strip");
+                
+                output.resize(outputSize);
+            }
+        }
+    
+        TiffStripWriter::TiffStripWriter(const std::string& outputPath, const int width, const int height, const TiffCompression compression) :
+            mFile(nullptr),
+            mWidth(width),
+            mHeight(height),
+            mCompression(compression),
+            mPendingRows(0),
+            mRowsEncoded(0),
+            mOffset(0),
+            mCommited(false)
+        {
+            if(width <= 0 || height <= 0)
+                throw InvalidState("Invalid TIFF size");
+            
+            mFile = fopen(outputPath.c_str(), "wb");
+            if(!mFile)
+                throw IOException("Cannot write to " + outputPath);
+            
+            // Little endian header, the directory offset is set when the image is commited
+            const uint8_t header[] = { 'I', 'I', 42, 0, 0, 0, 0, 0 };
+            
+            if(fwrite(header, 1, sizeof(header), mFile) != sizeof(header))
+                throw IOException("Failed to write TIFF");
+            
+            mOffset = sizeof(header);
+        }
+    
+        TiffStripWriter::~TiffStripWriter() {
+            if(mFile)
+                fclose(mFile);
+        }
+    
+        void TiffStripWriter::write(const cv::Mat& rows) {
+            if(mCommited)
+                throw IOException("Can't write rows because image has been commited");
+            
+            if(rows.cols != mWidth || rows.type() != CV_16UC3)
+                throw InvalidState("Invalid TIFF rows");
+            
+            if(mRowsEncoded + mPendingRows + rows.rows > mHeight)
+                throw InvalidState("Too many TIFF rows");
+            
+            std::vector<cv::Mat> strips;
+            int row = 0;
+            
+            while(row < rows.rows) {
+                if(mPendingRows == 0 && rows.rows - row >= TIFF_STRIP_HEIGHT) {
+                    strips.push_back(rows.rowRange(row, row + TIFF_STRIP_HEIGHT));
+                    row += TIFF_STRIP_HEIGHT;
+                    continue;
+                }
+                
+                if(mPending.empty())
+                    mPending.create(TIFF_STRIP_HEIGHT, mWidth, CV_16UC3);
+                
+                const int n = std::min(TIFF_STRIP_HEIGHT - mPendingRows, rows.rows - row);
+                
+                rows.rowRange(row, row + n).copyTo(mPending.rowRange(mPendingRows, mPendingRows + n));
+                
+                mPendingRows += n;
+                row += n;
+                
+                if(mPendingRows == TIFF_STRIP_HEIGHT) {
+                    strips.push_back(mPending);
+                    
+                    mPending = cv::Mat();
+                    mPendingRows = 0;
+                }
+            }
+            
+            encodeStrips(strips);
+        }
+    
+        void TiffStripWriter::encodeStrips(const std::vector<cv::Mat>& strips) {
+            if(strips.empty())
+                return;
+            
+            std::vector<std::vector<uint8_t>> encodedStrips(strips.size());
+            std::atomic<bool> failed(false);
+            
+            cv::parallel_for_(cv::Range(0, static_cast<int>(strips.size())), [&](const cv::Range& range) {
+                for(int i = range.start; i < range.end; i++) {
+                    try {
+                        EncodeTiffStrip(strips[i], mCompression, encodedStrips[i]);
+                    }
+                    catch(std::exception& e) {
+                        failed = true;
+                    }
+                }
+            });
+            
+            if(failed)
+                throw IOException("Failed to encode TIFF strip");
+            
+            for(size_t i = 0; i < strips.size(); i++) {
+                const size_t size = encodedStrips[i].size();
+                
+                if(mOffset + size > UINT32_MAX)
+                    throw IOException("TIFF is too large");
+                
+                if(fwrite(encodedStrips[i].data(), 1, size, mFile) != size)
+                    throw IOException("Failed to write TIFF");
+                
+                mStripOffsets.push_back(static_cast<uint32_t>(mOffset));
+                mStripByteCounts.push_back(static_cast<uint32_t>(size));
+                
+                mOffset += size;
+                mRowsEncoded += strips[i].rows;
+            }
+        }
+    
+        void TiffStripWriter::commit() {
+            if(mCommited)
+                return;
+            
+            if(mPendingRows > 0) {
+                encodeStrips({ mPending.rowRange(0, mPendingRows) });
+                mPendingRows = 0;
+            }
+            
+            if(mRowsEncoded != mHeight)
+                throw InvalidState("Incomplete TIFF image");
+            
+            // Directory has to start on a word boundary
+            vector<uint8_t> ifd;
+            
+            if(mOffset % 2 != 0)
+                ifd.push_back(0);
+            
+            const uint16_t numEntries = 14;
+            const uint32_t numStrips = static_cast<uint32_t>(mStripOffsets.size());
+            
+            const uint64_t ifdOffset = mOffset + ifd.size();
+            const uint64_t bitsPerSampleOffset = ifdOffset + 2 + numEntries*12 + 4;
+            const uint64_t resolutionOffset = bitsPerSampleOffset + 6;
+            const uint64_t stripOffsetsOffset = resolutionOffset + 8;
+            const uint64_t stripByteCountsOffset = stripOffsetsOffset + 4*numStrips;
+            
+            if(stripByteCountsOffset + 4*numStrips > UINT32_MAX)
+                throw IOException("TIFF is too large");
+            
+            PutTiff16(ifd, numEntries);
+            
+            PutTiffEntry(ifd, 256, 4, 1, mWidth);                                           // ImageWidth
+            PutTiffEntry(ifd, 257, 4, 1, mHeight);                                          // ImageLength
+            PutTiffEntry(ifd, 258, 3, 3, static_cast<uint32_t>(bitsPerSampleOffset));      // BitsPerSample
+            PutTiffEntry(ifd, 259, 3, 1, static_cast<uint32_t>(mCompression));              // Compression
+            PutTiffEntry(ifd, 262, 3, 1, 2);                                                // PhotometricInterpretation (RGB)
+            PutTiffEntry(ifd, 273, 4, numStrips,                                            // StripOffsets
+                         numStrips == 1 ? mStripOffsets[0] : static_cast<uint32_t>(stripOffsetsOffset));
+            PutTiffEntry(ifd, 277, 3, 1, 3);                                                // SamplesPerPixel
+            PutTiffEntry(ifd, 278, 4, 1, TIFF_STRIP_HEIGHT);                                // RowsPerStrip
+            PutTiffEntry(ifd, 279, 4, numStrips,                                            // StripByteCounts
+                         numStrips == 1 ? mStripByteCounts[0] : static_cast<uint32_t>(stripByteCountsOffset));
+            PutTiffEntry(ifd, 282, 5, 1, static_cast<uint32_t>(resolutionOffset));          // XResolution
+            PutTiffEntry(ifd, 283, 5, 1, static_cast<uint32_t>(resolutionOffset));          // YResolution
+            PutTiffEntry(ifd, 284, 3, 1, 1);                                                // PlanarConfiguration
+            PutTiffEntry(ifd, 296, 3, 1, 2);                                                // ResolutionUnit (inch)
+            PutTiffEntry(ifd, 317, 3, 1, 2);                                                // Predictor (horizontal)
+            
+            // No more directories
+            PutTiff32(ifd, 0);
+            
+            PutTiff16(ifd, 16);
+            PutTiff16(ifd, 16);
+            PutTiff16(ifd, 16);
+            
+            PutTiff32(ifd, 72);
+            PutTiff32(ifd, 1);
+            
+            if(numStrips > 1) {
+                for(auto offset : mStripOffsets)
+                    PutTiff32(ifd, offset);
+                
+                for(auto byteCount : mStripByteCounts)
+                    PutTiff32(ifd, byteCount);
+            }
+            
+            vector<uint8_t> ifdOffsetData;
+            PutTiff32(ifdOffsetData, static_cast<uint32_t>(ifdOffset));
+            
+            if(fwrite(ifd.data(), 1, ifd.size(), mFile) != ifd.size()           ||
+               fseek(mFile, 4, SEEK_SET) != 0                                   ||
+               fwrite(ifdOffsetData.data(), 1, ifdOffsetData.size(), mFile) != ifdOffsetData.size() ||
+               fclose(mFile) != 0)
+            {
+                mFile = nullptr;
+                throw IOException("Failed to write TIFF");
+            }
+            
+            mFile = nullptr;
+            mCommited = true;
+        }
+    
         //
 
         void ReadCompressedFile(const string& inputPath, vector<uint8_t>& output) {
@@ -352,9 +904,176 @@ namespace motioncam {
             return outputImage(cv::Rect(cropX, cropY, width - cropX*2, height - cropY*2)).clone();
         }
 
+        //
+        // DNG profile cache
+        //
+
+        struct DngProfileCache::Profile {
+            dng_camera_profile cameraProfile;
+        };
+
+        static dng_matrix_3by3 ToDngMatrix(const cv::Mat& m) {
+            return dng_matrix_3by3(m.at<float>(0, 0), m.at<float>(0, 1), m.at<float>(0, 2),
+                                   m.at<float>(1, 0), m.at<float>(1, 1), m.at<float>(1, 2),
+                                   m.at<float>(2, 0), m.at<float>(2, 1), m.at<float>(2, 2));
+        }
+
+        static uint32_t ToDngIlluminant(color::Illuminant illuminant) {
+            switch(illuminant) {
+                case color::StandardA:
+                    return lsStandardLightA;
+                case color::StandardB:
+                    return lsStandardLightB;
+                case color::StandardC:
+                    return lsStandardLightC;
+                case color::D50:
+                    return lsD50;
+                case color::D55:
+                    return lsD55;
+                case color::D65:
+                    return lsD65;
+                case color::D75:
+                    return lsD75;
+            }
+
+            return 0;
+        }
+
+        DngProfileCache::DngProfileCache(const RawCameraMetadata& cameraMetadata) :
+            mProfile(new Profile())
+        {
+            dng_camera_profile& cameraProfile = mProfile->cameraProfile;
+
+            cameraProfile.SetColorMatrix1(ToDngMatrix(cameraMetadata.colorMatrix1));
+            cameraProfile.SetColorMatrix2(ToDngMatrix(cameraMetadata.colorMatrix2));
+
+            if(!cameraMetadata.forwardMatrix1.empty() && !cameraMetadata.forwardMatrix2.empty()) {
+                cameraProfile.SetForwardMatrix1(ToDngMatrix(cameraMetadata.forwardMatrix1));
+                cameraProfile.SetForwardMatrix2(ToDngMatrix(cameraMetadata.forwardMatrix2));
+            }
+
+            cameraProfile.SetCalibrationIlluminant1(ToDngIlluminant(cameraMetadata.colorIlluminant1));
+            cameraProfile.SetCalibrationIlluminant2(ToDngIlluminant(cameraMetadata.colorIlluminant2));
+
+            cameraProfile.SetName("MotionCam");
+            cameraProfile.SetEmbedPolicy(pepAllowCopying);
+
+            // This ensures profile is saved
+            cameraProfile.SetWasReadFromDNG();
+        }
+
+        DngProfileCache::~DngProfileCache() {
+        }
+
+        void DngProfileCache::setCropArea(const cv::Rect& cropArea, const cv::Size& fullSize) {
+            mCropArea = cropArea;
+            mFullSize = fullSize;
+
+            // Gain map coordinates depend on the crop
+            mOpcodeList2.clear();
+        }
+
+        bool DngProfileCache::shadingMapChanged(const RawImageMetadata& imageMetadata) const {
+            const auto& shadingMap = imageMetadata.lensShadingMap;
+
+            if(shadingMap.size() != mShadingMap.size())
+                return true;
+
+            for(size_t c = 0; c < shadingMap.size(); c++) {
+                const cv::Mat& a = shadingMap[c];
+                const cv::Mat& b = mShadingMap[c];
+
+                if(a.size() != b.size() || a.type() != b.type())
+                    return true;
+
+                const size_t rowBytes = a.cols * a.elemSize();
+
+                for(int y = 0; y < a.rows; y++) {
+                    if(std::memcmp(a.ptr(y), b.ptr(y), rowBytes) != 0)
+                        return true;
+                }
+            }
+
+            return false;
+        }
+
+        void DngProfileCache::updateOpcodes(dng_host& host, const RawImageMetadata& imageMetadata, int width, int height) {
+            // Most recordings use the same shading map for every frame
+            if(!mOpcodeList2.empty() && mOpcodeListSize == cv::Size(width, height) && !shadingMapChanged(imageMetadata))
+                return;
+
+            dng_opcode_list opcodeList(2);
+
+            // Create lens shading map for each channel
+            for(int c = 0; c < 4; c++) {
+                const cv::Mat& shadingMap = imageMetadata.lensShadingMap[c];
+
+                const int rows = shadingMap.rows;
+                const int cols = shadingMap.cols;
+
+                dng_point channelGainMapPoints(rows, cols);
+                dng_point_real64 spacing(1.0 / rows, 1.0 / cols);
+                dng_point_real64 origin(0, 0);
+
+                // Gain map coordinates are relative to the image so scale and shift them into the cropped area
+                if(mCropArea.area() > 0) {
+                    spacing.v *= mFullSize.height / (double) mCropArea.height;
+                    spacing.h *= mFullSize.width / (double) mCropArea.width;
+
+                    origin.v = -mCropArea.y / (double) mCropArea.height;
+                    origin.h = -mCropArea.x / (double) mCropArea.width;
+                }
+
+                AutoPtr<dng_gain_map> gainMap(new dng_gain_map(host.Allocator(),
+                                                               channelGainMapPoints,
+                                                               spacing,
+                                                               origin,
+                                                               1));
+
+                for(int y = 0; y < rows; y++) {
+                    for(int x = 0; x < cols; x++) {
+                        gainMap->Entry(y, x, 0) = shadingMap.at<float>(y, x);
+                    }
+                }
+
+                int left = c % 2;
+                int top  = c / 2;
+
+                dng_rect gainMapArea(top, left, height, width);
+                AutoPtr<dng_opcode> gainMapOpCode(new dng_opcode_GainMap(dng_area_spec(gainMapArea, 0, 1, 2, 2), gainMap));
+
+                opcodeList.Append(gainMapOpCode);
+            }
+
+            // Keep the serialised list, each negative parses its own copy
+            AutoPtr<dng_memory_block> block(opcodeList.Spool(host));
+
+            mOpcodeList2.assign(block->Buffer_uint8(), block->Buffer_uint8() + block->LogicalSize());
+            mOpcodeListSize = cv::Size(width, height);
+
+            mShadingMap.clear();
+
+            for(const auto& m : imageMetadata.lensShadingMap)
+                mShadingMap.push_back(m.clone());
+        }
+
+        void DngProfileCache::apply(dng_host& host, dng_negative& negative, const RawImageMetadata& imageMetadata, int width, int height) {
+            updateOpcodes(host, imageMetadata, width, height);
+
+            dng_stream opcodeStream(mOpcodeList2.data(), static_cast<uint32>(mOpcodeList2.size()));
+
+            negative.OpcodeList2().Parse(host, opcodeStream, static_cast<uint32>(mOpcodeList2.size()), 0);
+
+            // The negative takes ownership of its profile so give it a copy of the cached one
+            AutoPtr<dng_camera_profile> cameraProfile(new dng_camera_profile(mProfile->cameraProfile));
+
+            negative.AddProfile(cameraProfile);
+        }
+
         void WriteDng(cv::Mat& rawImage,
                       const RawCameraMetadata& cameraMetadata,
                       const RawImageMetadata& imageMetadata,
+                      DngProfileCache& profileCache,
                       dng_stream& dngStream)
         {
             const int width  = rawImage.cols;
@@ -367,48 +1086,6 @@ namespace motioncam {
             
             AutoPtr<dng_negative> negative(host.Make_dng_negative());
             
-            // Create lens shading map for each channel
-            for(int c = 0; c < 4; c++) {
-                dng_point channelGainMapPoints(imageMetadata.lensShadingMap[c].rows, imageMetadata.lensShadingMap[c].cols);
-                
-                AutoPtr<dng_gain_map> gainMap(new dng_gain_map(host.Allocator(),
-                                                               channelGainMapPoints,
-                                                               dng_point_real64(1.0 / (imageMetadata.lensShadingMap[c].rows), 1.0 / (imageMetadata.lensShadingMap[c].cols)),
-                                                               dng_point_real64(0, 0),
-                                                               1));
-                
-                for(int y = 0; y < imageMetadata.lensShadingMap[c].rows; y++) {
-                    for(int x = 0; x < imageMetadata.lensShadingMap[c].cols; x++) {
-                        gainMap->Entry(y, x, 0) = imageMetadata.lensShadingMap[c].at<float>(y, x);
-                    }
-                }
-                
-                int left = 0;
-                int top  = 0;
-                
-                if(c == 0) {
-                    left = 0;
-                    top = 0;
-                }
-                else if(c == 1) {
-                    left = 1;
-                    top = 0;
-                }
-                else if(c == 2) {
-                    left = 0;
-                    top = 1;
-                }
-                else if(c == 3) {
-                    left = 1;
-                    top = 1;
-                }
-                
-                dng_rect gainMapArea(top, left, height, width);
-                AutoPtr<dng_opcode> gainMapOpCode(new dng_opcode_GainMap(dng_area_spec(gainMapArea, 0, 1, 2, 2), gainMap));
-                
-                negative->OpcodeList2().Append(gainMapOpCode);
-            }
-            
             negative->SetModelName("MotionCam");
             negative->SetLocalName("MotionCam");
             
@@ -477,103 +1154,8 @@ namespace motioncam {
             
             negative->SetBaseOrientation(orientation);
 
-            // Set up camera profile
-            AutoPtr<dng_camera_profile> cameraProfile(new dng_camera_profile());
-            
-            // Color matrices
-            cv::Mat color1 = cameraMetadata.colorMatrix1;
-            cv::Mat color2 = cameraMetadata.colorMatrix2;
-            
-            dng_matrix_3by3 dngColor1 = dng_matrix_3by3(color1.at<float>(0, 0), color1.at<float>(0, 1), color1.at<float>(0, 2),
-                                                        color1.at<float>(1, 0), color1.at<float>(1, 1), color1.at<float>(1, 2),
-                                                        color1.at<float>(2, 0), color1.at<float>(2, 1), color1.at<float>(2, 2));
-            
-            dng_matrix_3by3 dngColor2 = dng_matrix_3by3(color2.at<float>(0, 0), color2.at<float>(0, 1), color2.at<float>(0, 2),
-                                                        color2.at<float>(1, 0), color2.at<float>(1, 1), color2.at<float>(1, 2),
-                                                        color2.at<float>(2, 0), color2.at<float>(2, 1), color2.at<float>(2, 2));
-            
-            cameraProfile->SetColorMatrix1(dngColor1);
-            cameraProfile->SetColorMatrix2(dngColor2);
-            
-            // Forward matrices
-            cv::Mat forward1 = cameraMetadata.forwardMatrix1;
-            cv::Mat forward2 = cameraMetadata.forwardMatrix2;
-            
-            if(!forward1.empty() && !forward2.empty()) {
-                dng_matrix_3by3 dngForward1 = dng_matrix_3by3( forward1.at<float>(0, 0), forward1.at<float>(0, 1), forward1.at<float>(0, 2),
-                                                               forward1.at<float>(1, 0), forward1.at<float>(1, 1), forward1.at<float>(1, 2),
-                                                               forward1.at<float>(2, 0), forward1.at<float>(2, 1), forward1.at<float>(2, 2) );
-                
-                dng_matrix_3by3 dngForward2 = dng_matrix_3by3( forward2.at<float>(0, 0), forward2.at<float>(0, 1), forward2.at<float>(0, 2),
-                                                               forward2.at<float>(1, 0), forward2.at<float>(1, 1), forward2.at<float>(1, 2),
-                                                               forward2.at<float>(2, 0), forward2.at<float>(2, 1), forward2.at<float>(2, 2) );
-                
-                cameraProfile->SetForwardMatrix1(dngForward1);
-                cameraProfile->SetForwardMatrix2(dngForward2);
-            }
-            
-            uint32_t illuminant1 = 0;
-            uint32_t illuminant2 = 0;
-            
-            // Convert to DNG format
-            switch(cameraMetadata.colorIlluminant1) {
-                case color::StandardA:
-                    illuminant1 = lsStandardLightA;
-                    break;
-                case color::StandardB:
-                    illuminant1 = lsStandardLightB;
-                    break;
-                case color::StandardC:
-                    illuminant1 = lsStandardLightC;
-                    break;
-                case color::D50:
-                    illuminant1 = lsD50;
-                    break;
-                case color::D55:
-                    illuminant1 = lsD55;
-                    break;
-                case color::D65:
-                    illuminant1 = lsD65;
-                    break;
-                case color::D75:
-                    illuminant1 = lsD75;
-                    break;
-            }
-            
-            switch(cameraMetadata.colorIlluminant2) {
-                case color::StandardA:
-                    illuminant2 = lsStandardLightA;
-                    break;
-                case color::StandardB:
-                    illuminant2 = lsStandardLightB;
-                    break;
-                case color::StandardC:
-                    illuminant2 = lsStandardLightC;
-                    break;
-                case color::D50:
-                    illuminant2 = lsD50;
-                    break;
-                case color::D55:
-                    illuminant2 = lsD55;
-                    break;
-                case color::D65:
-                    illuminant2 = lsD65;
-                    break;
-                case color::D75:
-                    illuminant2 = lsD75;
-                    break;
-            }
-            
-            cameraProfile->SetCalibrationIlluminant1(illuminant1);
-            cameraProfile->SetCalibrationIlluminant2(illuminant2);
-            
-            cameraProfile->SetName("MotionCam");
-            cameraProfile->SetEmbedPolicy(pepAllowCopying);
-            
-            // This ensures profile is saved
-            cameraProfile->SetWasReadFromDNG();
-            
-            negative->AddProfile(cameraProfile);
+            // Lens shading opcodes and camera profile
+            profileCache.apply(host, *negative, imageMetadata, width, height);
             
             // Finally add the raw data to the negative
             dng_rect dngArea(height, width);
@@ -608,11 +1190,12 @@ namespace motioncam {
         void WriteDng(cv::Mat& rawImage,
                       const RawCameraMetadata& cameraMetadata,
                       const RawImageMetadata& imageMetadata,
+                      DngProfileCache& profileCache,
                       const std::string& outputPath)
         {
-            dng_file_stream stream(outputPath.c_str());
+            dng_file_stream stream(outputPath.c_str(), true);
             
-            WriteDng(rawImage, cameraMetadata, imageMetadata, stream);
+            WriteDng(rawImage, cameraMetadata, imageMetadata, profileCache, stream);
             
             stream.Flush();
         }
@@ -620,25 +1203,88 @@ namespace motioncam {
         void WriteDng(cv::Mat& rawImage,
                       const RawCameraMetadata& cameraMetadata,
                       const RawImageMetadata& imageMetadata,
+                      DngProfileCache& profileCache,
                       ZipWriter& zipWriter,
                       const std::string& outputName)
         {
-            dng_memory_stream stream(gDefaultDNGMemoryAllocator);
+            EncodedDng dng(rawImage, cameraMetadata, imageMetadata, profileCache);
             
-            WriteDng(rawImage, cameraMetadata, imageMetadata, stream);
+            try {
+                dng.write(zipWriter, outputName);
+            }
+            catch(std::runtime_error& e) {
+            }
+        }
+
+        //
+        // Encoded DNG
+        //
+
+        EncodedDng::EncodedDng(cv::Mat& rawImage,
+                               const RawCameraMetadata& cameraMetadata,
+                               const RawImageMetadata& imageMetadata,
+                               DngProfileCache& profileCache) :
+            mStream(new dng_memory_stream(gDefaultDNGMemoryAllocator))
+        {
+            WriteDng(rawImage, cameraMetadata, imageMetadata, profileCache, *mStream);
             
-            stream.Flush();
+            mStream->Flush();
+        }
+
+        EncodedDng::~EncodedDng() {
+        }
+
+        size_t EncodedDng::size() const {
+            return static_cast<size_t>(mStream->Length());
+        }
+
+        size_t EncodedDng::read(void* opaque, mz_uint64 offset, void* buffer, size_t n) {
+            auto* stream = static_cast<dng_memory_stream*>(opaque);
             
-            auto memoryBlock = stream.AsMemoryBlock(gDefaultDNGMemoryAllocator);
+            stream->SetReadPosition(offset);
+            stream->Get(buffer, static_cast<uint32>(n));
             
+            return n;
+        }
+
+        void EncodedDng::write(ZipWriter& zipWriter, const std::string& outputName) {
+            zipWriter.addFile(outputName, &EncodedDng::read, mStream.get(), size());
+        }
+
+        void EncodedDng::write(const std::string& outputPath) {
             try {
-                if(memoryBlock)
-                    zipWriter.addFile(outputName, memoryBlock->Buffer_uint8(), memoryBlock->LogicalSize());
+                dng_file_stream file(outputPath.c_str(), true);
+                
+                // Copied from the pages of the memory stream
+                mStream->SetReadPosition(0);
+                mStream->CopyToStream(file, mStream->Length());
+                
+                file.Flush();
             }
-            catch(std::runtime_error& e) {
+            catch(dng_exception& e) {
+                throw IOException("Cannot write " + outputPath);
             }
-            
-            delete memoryBlock;
+        }
+
+        void WriteDng(cv::Mat& rawImage,
+                      const RawCameraMetadata& cameraMetadata,
+                      const RawImageMetadata& imageMetadata,
+                      const std::string& outputPath)
+        {
+            DngProfileCache profileCache(cameraMetadata);
+
+            WriteDng(rawImage, cameraMetadata, imageMetadata, profileCache, outputPath);
+        }
+    
+        void WriteDng(cv::Mat& rawImage,
+                      const RawCameraMetadata& cameraMetadata,
+                      const RawImageMetadata& imageMetadata,
+                      ZipWriter& zipWriter,
+                      const std::string& outputName)
+        {
+            DngProfileCache profileCache(cameraMetadata);
+
+            WriteDng(rawImage, cameraMetadata, imageMetadata, profileCache, zipWriter, outputName);
         }
 
     }
@@ -1,6 +1,8 @@
 #include <iostream>
 #include <iomanip>
 #include <sstream>
+#include <cerrno>
+#include <cstdio>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -29,7 +31,7 @@ public:
 
 class DngOutputListener : public motioncam::DngProcessorProgress {
 public:
-    DngOutputListener(const std::string& outputPath) : outputPath(outputPath) {
+    DngOutputListener(const std::string& outputPath, bool printStats) : outputPath(outputPath), printStats(printStats) {
     }
     
     int onNeedFd(int threadNumber) const {
@@ -46,36 +48,64 @@ public:
     }
     
     bool onProgressUpdate(int progress) const {
-        std::cout << progress << "%" << std::endl;
+        // Keep output machine readable when printing stats
+        if(!printStats)
+            std::cout << progress << "%" << std::endl;
         return true;
     }
     
     void onCompleted() const {
-        std::cout << "DONE" << std::endl;
+        if(!printStats)
+            std::cout << "DONE" << std::endl;
     }
     
     void onError(const std::string& error) const {
         std::cout << "ERROR: " << error << std::endl;
     }
     
+    void onStats(const std::string& stats) const {
+        if(printStats)
+            std::cout << stats << std::endl;
+    }
+    
 private:
     std::string outputPath;
+    bool printStats;
 };
 
 void printHelp() {
-    std::cout << "Usage: convert [-t] [-I] file.zip /output/path" << std::endl << std::endl;
+    std::cout << "Usage: convert [-t] [-I] [-d] [--stats] [--start] [--end] [--stride] [--crop] [--proxy] [--proxy-scale] [--proxy-fast] file.zip /output/path" << std::endl;
+    std::cout << "       convert --estimate [--start] [--end] [--stride] file.zip" << std::endl << std::endl;
     std::cout << "-t\tNumber of threads" << std::endl;
-    std::cout << "-I\tProcess as image" << std::endl;
+    std::cout << "-I\tProcess as image, an output path ending in .tif writes a 16-bit TIFF" << std::endl;
+    std::cout << "-d\tWrite DNG sequence directly to output path instead of zip files" << std::endl;
+    std::cout << "--stats\tPrint throughput and per-stage timings as JSON" << std::endl;
+    std::cout << "--start\tFirst frame to export" << std::endl;
+    std::cout << "--end\tLast frame to export" << std::endl;
+    std::cout << "--stride\tExport every Nth frame" << std::endl;
+    std::cout << "--crop\tExport region as x,y,width,height" << std::endl;
+    std::cout << "--proxy\tWrite a preview proxy instead of DNGs, either jpg (image sequence) or y4m" << std::endl;
+    std::cout << "--proxy-scale\tProxy downscale factor relative to half resolution (1, 2, 4 or 8)" << std::endl;
+    std::cout << "--proxy-fast\tRender the proxy with the faster, lower quality preview" << std::endl;
+    std::cout << "--estimate\tPrint the live preview settings estimate after each frame as JSON" << std::endl;
 }
 
 int main(int argc, const char* argv[]) {    
-    if(argc < 3) {
+    if(argc < 2) {
         printHelp();
         return 1;
     }
     
     int numThreads = 4;
     bool processAsImage = false;
+    bool writeToDirectory = false;
+    bool printStats = false;
+    bool writeProxy = false;
+    bool estimateSettings = false;
+    int proxyScale = 2;
+    bool proxyFast = false;
+    motioncam::ProxyFormat proxyFormat = motioncam::ProxyFormat::JPEG_SEQUENCE;
+    motioncam::DngExportOptions exportOptions;
     
     int i = 1;
     
@@ -92,12 +122,99 @@ int main(int argc, const char* argv[]) {
         else if(std::string(argv[i]) == "-I") {
             processAsImage = true;
         }
+        else if(std::string(argv[i]) == "-d") {
+            writeToDirectory = true;
+        }
+        else if(std::string(argv[i]) == "--stats") {
+            printStats = true;
+        }
+        else if(std::string(argv[i]) == "--estimate") {
+            estimateSettings = true;
+        }
+        else if(std::string(argv[i]) == "--start" ||
+                std::string(argv[i]) == "--end" ||
+                std::string(argv[i]) == "--stride")
+        {
+            if(i + 1 >= argc) {
+                printHelp();
+                exit(1);
+            }
+            
+            int value = std::stoi(argv[i+1]);
+            
+            if(std::string(argv[i]) == "--start")
+                exportOptions.startFrame = value;
+            else if(std::string(argv[i]) == "--end")
+                exportOptions.endFrame = value;
+            else
+                exportOptions.frameStride = value;
+            
+            ++i;
+        }
+        else if(std::string(argv[i]) == "--crop") {
+            if(i + 1 >= argc ||
+               sscanf(argv[i+1], "%d,%d,%d,%d",
+                      &exportOptions.cropX, &exportOptions.cropY, &exportOptions.cropWidth, &exportOptions.cropHeight) != 4)
+            {
+                printHelp();
+                exit(1);
+            }
+            
+            ++i;
+        }
+        else if(std::string(argv[i]) == "--proxy") {
+            if(i + 1 >= argc) {
+                printHelp();
+                exit(1);
+            }
+            
+            if(std::string(argv[i+1]) == "jpg")
+                proxyFormat = motioncam::ProxyFormat::JPEG_SEQUENCE;
+            else if(std::string(argv[i+1]) == "y4m")
+                proxyFormat = motioncam::ProxyFormat::Y4M;
+            else {
+                printHelp();
+                exit(1);
+            }
+            
+            writeProxy = true;
+            ++i;
+        }
+        else if(std::string(argv[i]) == "--proxy-scale") {
+            if(i + 1 >= argc) {
+                printHelp();
+                exit(1);
+            }
+            
+            proxyScale = std::stoi(argv[i+1]);
+            ++i;
+        }
+        else if(std::string(argv[i]) == "--proxy-fast") {
+            proxyFast = true;
+        }
         else {
             break;
         }
     }
     
-    if(i + 1 > argc) {
+    if(estimateSettings) {
+        if(i >= argc) {
+            printHelp();
+            exit(1);
+        }
+        
+        try {
+            motioncam::EstimateVideoSettings(argv[i], std::cout, exportOptions);
+        }
+        catch(std::runtime_error& e) {
+            std::cerr << "ERROR: " << e.what() << std::endl;
+            return 1;
+        }
+        
+        return 0;
+    }
+    
+    if(i + 1 >= argc) {
         printHelp();
         exit(1);
     }
@@ -112,7 +229,8 @@ int main(int argc, const char* argv[]) {
     }
     
     try {
-        std::cout << "Opening " << inputFile << std::endl;
+        if(!printStats)
+            std::cout << "Opening " << inputFile << std::endl;
 
         if(processAsImage) {
             ProgressListener progressListener;
@@ -120,11 +238,32 @@ int main(int argc, const char* argv[]) {
             motioncam::ProcessImage(inputFile, outputPath, progressListener);
         }
         else {
-            DngOutputListener listener(outputPath);
+            DngOutputListener listener(outputPath, printStats);
 
-            std::cout << "Using " << numThreads << " threads" << std::endl;
+            if(!printStats)
+                std::cout << "Using " << numThreads << " threads" << std::endl;
 
-            motioncam::ConvertVideoToDNG(inputFile, listener, numThreads);
+            if(writeProxy || writeToDirectory) {
+                if(mkdir(outputPath.c_str(), S_IRWXU|S_IRGRP|S_IXGRP) != 0 && errno != EEXIST) {
+                    std::cerr << "ERROR: Can't create " << outputPath << std::endl;
+                    return 1;
+                }
+
+                if(writeProxy && proxyFormat == motioncam::ProxyFormat::Y4M) {
+                    motioncam::ConvertVideoToProxy(
+                        inputFile, outputPath + "/proxy.y4m", listener, proxyFormat, proxyScale, numThreads, exportOptions, proxyFast);
+                }
+                else if(writeProxy) {
+                    motioncam::ConvertVideoToProxy(
+                        inputFile, outputPath, listener, proxyFormat, proxyScale, numThreads, exportOptions, proxyFast);
+                }
+                else {
+                    motioncam::ConvertVideoToDNG(inputFile, outputPath, listener, numThreads, exportOptions);
+                }
+            }
+            else {
+                motioncam::ConvertVideoToDNG(inputFile, listener, numThreads, exportOptions);
+            }
         }
     }
     catch(std::runtime_error& e) {